@@ -0,0 +1,485 @@
+#include "movies_common.h"
+
+// One harness for every index: the tree sources are compiled in without their
+// demo mains and all of them run the same synthetic workloads, timed per
+// operation with a monotonic clock and reported as p50/p99 in CSV or JSON.
+#define TREE_NO_MAIN
+#include "tree_kdtree.c"
+#include "tree_quad.c"
+#include "tree_range.c"
+#include "tree_rtree.c"
+
+#define BENCH_CLUSTERS 16
+
+// Value ranges of the synthetic columns, in dim_fields order: Budget, Popularity,
+// Runtime, Vote Avg, Revenue
+const double gen_lo[NUM_DIM_FIELDS] = { 0.0, 0.0, 40.0, 0.0, 0.0 };
+const double gen_hi[NUM_DIM_FIELDS] = { 3e8, 100.0, 240.0, 10.0, 1e9 };
+
+// --- Random numbers (xorshift64*), independent of the C library's rand() ---
+#define RNG_SEED 88172645463325252ull
+unsigned long long rng_state = RNG_SEED;
+
+unsigned long long rng_next() {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 2685821657736338717ull;
+}
+
+double rng_unit() {
+    return (rng_next() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+double rng_normal() {
+    double u = rng_unit(), v = rng_unit();
+    if (u < 1e-300) u = 1e-300;
+    return sqrt(-2.0 * log(u)) * cos(2.0 * M_PI * v);
+}
+
+// --- Synthetic catalogs ---
+// Uniform: every column uniform over its range. Clustered: Gaussian blobs
+// around BENCH_CLUSTERS random centers (kept off the range edges so little
+// is clamped), 3% of the range wide per dimension.
+void gen_dataset(int clustered, int n) {
+    double centers[BENCH_CLUSTERS][MAX_DIMS];
+    for(int c=0; c<BENCH_CLUSTERS; c++) {
+        for(int d=0; d<k_dims; d++) centers[c][d] = gen_lo[dim_field[d]] + (0.1 + 0.8 * rng_unit()) * (gen_hi[dim_field[d]] - gen_lo[dim_field[d]]);
+    }
+    store_free();
+    store_init(n);
+    for(int i=0; i<n; i++) {
+        double v[MAX_DIMS];
+        int c = (int)(rng_next() % BENCH_CLUSTERS);
+        for(int d=0; d<k_dims; d++) {
+            double span = gen_hi[dim_field[d]] - gen_lo[dim_field[d]];
+            if (clustered) {
+                v[d] = centers[c][d] + 0.03 * span * rng_normal();
+                if (v[d] < gen_lo[dim_field[d]]) v[d] = gen_lo[dim_field[d]];
+                if (v[d] > gen_hi[dim_field[d]]) v[d] = gen_hi[dim_field[d]];
+            } else v[d] = gen_lo[dim_field[d]] + rng_unit() * span;
+        }
+        int id = store_add(v);
+        snprintf(db.info[id].title, sizeof(db.info[id].title), "synthetic %d", id);
+        db.info[id].text_feature[0] = '\0';
+        memset(db.info[id].minhash_sig, 0xFF, sizeof(db.info[id].minhash_sig));
+    }
+}
+
+// --- Query boxes with a controlled selectivity ---
+// Each box spans the same fraction of every column's ranks around a random
+// movie. With independent columns a fraction s^(1/K) holds about s*n movies;
+// clustered data correlates the columns, so the fraction is scaled by a
+// factor calibrated per dataset. The measured share is reported as well.
+double *sorted_col[MAX_DIMS];
+double box_scale[8]; // Per selectivity, set by calibrate_boxes
+
+int cmp_double(const void *a, const void *b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+void prepare_quantiles() {
+    for(int d=0; d<k_dims; d++) {
+        free(sorted_col[d]);
+        sorted_col[d] = malloc(db.count * sizeof(double));
+        memcpy(sorted_col[d], db.col[d], db.count * sizeof(double));
+        qsort(sorted_col[d], db.count, sizeof(double), cmp_double);
+    }
+}
+
+void selectivity_box(double s, double scale, double min[], double max[]) {
+    int n = db.count, c = (int)(rng_next() % n);
+    double frac = scale * pow(s, 1.0 / k_dims);
+    int w = (int)((frac < 1.0 ? frac : 1.0) * n);
+    for(int d=0; d<k_dims; d++) {
+        double *col = sorted_col[d];
+        int lo = 0, hi = n;
+        while (lo < hi) {
+            int mid = lo + (hi - lo) / 2;
+            if (col[mid] < db.col[d][c]) lo = mid + 1; else hi = mid;
+        }
+        int a = lo - w / 2;
+        if (a < 0) a = 0;
+        if (a + w > n - 1) a = (n - 1 - w > 0) ? n - 1 - w : 0;
+        int b = (a + w < n) ? a + w : n - 1;
+        min[d] = col[a];
+        max[d] = col[b];
+    }
+}
+
+// Mean share of the catalog inside sample boxes, by brute force
+double measure_selectivity(double s, double scale) {
+    unsigned long long saved = rng_state;
+    rng_state = 0x9E3779B97F4A7C15ull; // Same sample boxes for every probe
+    long hits = 0;
+    int samples = 32;
+    for(int q=0; q<samples; q++) {
+        double min[MAX_DIMS], max[MAX_DIMS];
+        selectivity_box(s, scale, min, max);
+        for(int id=0; id<db.count; id++) hits += point_in_box(id, min, max);
+    }
+    rng_state = saved;
+    return (double)hits / ((double)samples * db.count);
+}
+
+// Bisects the scale (on a log axis) until the sample boxes hit the target
+void calibrate_boxes(const double *sel, int nsel) {
+    for(int j=0; j<nsel; j++) {
+        double lo = 0.01, hi = 1.0 / pow(sel[j], 1.0 / k_dims);
+        for(int it=0; it<14; it++) {
+            double mid = sqrt(lo * hi);
+            if (measure_selectivity(sel[j], mid) > sel[j]) hi = mid; else lo = mid;
+        }
+        box_scale[j] = sqrt(lo * hi);
+    }
+}
+
+// --- Latency samples and output ---
+typedef struct {
+    double *v;
+    int n, cap;
+} Samples;
+
+void sample_add(Samples *s, double x) {
+    if (s->n == s->cap) {
+        s->cap = s->cap ? 2 * s->cap : 256;
+        s->v = realloc(s->v, s->cap * sizeof(double));
+    }
+    s->v[s->n++] = x;
+}
+
+FILE *out;
+int out_json = 0, out_rows = 0;
+const char *cur_dataset;
+int cur_n;
+
+// One result row; times are in microseconds. extra is workload specific:
+// range: measured share of the catalog returned, memory: bytes,
+// aggregate: share of counts equal to the range query's, delete: share of
+// the catalog still live after the mix.
+void report(const char *index, const char *workload, const char *param, Samples *s, double extra) {
+    double p50 = 0.0, p99 = 0.0, mean = 0.0;
+    if (s && s->n > 0) {
+        qsort(s->v, s->n, sizeof(double), cmp_double);
+        p50 = s->v[(s->n - 1) / 2];
+        p99 = s->v[(int)ceil(0.99 * s->n) - 1];
+        for(int i=0; i<s->n; i++) mean += s->v[i];
+        mean /= s->n;
+    }
+    int ops = s ? s->n : 0;
+    if (out_json) {
+        fprintf(out, "%s  {\"dataset\": \"%s\", \"n\": %d, \"index\": \"%s\", \"workload\": \"%s\", \"param\": \"%s\", "
+                "\"ops\": %d, \"p50_us\": %.3f, \"p99_us\": %.3f, \"mean_us\": %.3f, \"extra\": %.6g}",
+                out_rows ? ",\n" : "", cur_dataset, cur_n, index, workload, param, ops, p50 * 1e6, p99 * 1e6, mean * 1e6, extra);
+    } else {
+        fprintf(out, "%s,%d,%s,%s,%s,%d,%.3f,%.3f,%.3f,%.6g\n",
+                cur_dataset, cur_n, index, workload, param, ops, p50 * 1e6, p99 * 1e6, mean * 1e6, extra);
+    }
+    out_rows++;
+    if (s) s->n = 0;
+}
+
+// --- The indexes behind one interface ---
+typedef struct {
+    const char *name;
+    void (*build)(int *ids, int n);
+    void (*query)(double min[], double max[], int *res, int *cnt);
+    void (*aggregate)(double min[], double max[], Agg *out);
+    int (*knn)(int target, int k, Neighbor *out); // NULL: exact search through query()
+    void (*insert)(int id);                       // NULL: static layout
+    void (*remove)(int id);                       // NULL: tombstone only
+    long (*memory)();
+    void (*destroy)();
+} BenchIndex;
+
+KDNode *b_kd;
+FlatKD b_flat;
+QuadNode *b_quad;
+RangeNode *b_range;
+RNode *b_rtree;
+
+void b_kd_build(int *ids, int n) { b_kd = build_kdtree(ids, n, 0); }
+void b_kd_query(double min[], double max[], int *res, int *cnt) { query_kdtree(b_kd, min, max, res, cnt); }
+int b_kd_knn(int target, int k, Neighbor *out) { return knn_kdtree(b_kd, target, k, out); }
+void b_kd_insert(int id) { b_kd = insert_kdtree(b_kd, id, 0); }
+void b_kd_remove(int id) { delete_kdtree(&b_kd, id); db.deleted[id] = 1; }
+void b_kd_agg(double min[], double max[], Agg *out) { agg_kdtree(b_kd, min, max, out); }
+long b_kd_memory() { return get_kd_memory(b_kd); }
+void b_kd_destroy() { reset_kd_arena(); b_kd = NULL; }
+
+void b_flat_build(int *ids, int n) { build_flatkd(&b_flat, ids, n); }
+void b_flat_query(double min[], double max[], int *res, int *cnt) { query_flatkd(&b_flat, min, max, res, cnt); }
+void b_flat_agg(double min[], double max[], Agg *out) { agg_flatkd(&b_flat, min, max, out); }
+int b_flat_knn(int target, int k, Neighbor *out) { return knn_flatkd(&b_flat, target, k, out); }
+void b_flat_remove(int id) { delete_flatkd(&b_flat, id); db.deleted[id] = 1; }
+long b_flat_memory() { return flatkd_memory(&b_flat); }
+void b_flat_destroy() { free_flatkd(&b_flat); }
+
+void b_quad_build(int *ids, int n) { b_quad = build_quad(ids, n); }
+void b_quad_query(double min[], double max[], int *res, int *cnt) { query_quad(b_quad, min, max, res, cnt); }
+void b_quad_agg(double min[], double max[], Agg *out) { agg_quad(b_quad, min, max, out); }
+void b_quad_insert(int id) { b_quad = insert_quad_root(b_quad, id); }
+void b_quad_remove(int id) { delete_quad(&b_quad, id); db.deleted[id] = 1; }
+long b_quad_memory() { return get_quad_memory(b_quad); }
+void b_quad_destroy() { reset_quad_arena(); b_quad = NULL; }
+
+void b_range_build(int *ids, int n) { b_range = build_range(ids, n); }
+void b_range_query(double min[], double max[], int *res, int *cnt) { query_range(b_range, min, max, res, cnt); }
+void b_range_agg(double min[], double max[], Agg *out) { agg_range(b_range, min, max, out); }
+void b_range_insert(int id) { insert_range(&b_range, id); }
+void b_range_remove(int id) { delete_range(&b_range, id); db.deleted[id] = 1; }
+long b_range_memory() { return get_range_memory(b_range); }
+void b_range_destroy() { reset_range_arena(); b_range = NULL; }
+
+void b_rtree_build(int *ids, int n) { b_rtree = build_rtree(ids, n); }
+void b_rtree_query(double min[], double max[], int *res, int *cnt) { query_rtree(b_rtree, min, max, res, cnt); }
+void b_rtree_agg(double min[], double max[], Agg *out) { agg_rtree(b_rtree, min, max, out); }
+void b_rtree_insert(int id) { insert_rtree(&b_rtree, id); }
+void b_rtree_remove(int id) { delete_rtree(&b_rtree, id); db.deleted[id] = 1; }
+long b_rtree_memory() { return get_rtree_memory(b_rtree); }
+void b_rtree_destroy() { reset_rtree_arena(); b_rtree = NULL; }
+
+BenchIndex bench_indexes[] = {
+    { "kdtree",  b_kd_build,    b_kd_query,    b_kd_agg,    b_kd_knn,   b_kd_insert,    b_kd_remove,    b_kd_memory,    b_kd_destroy },
+    { "kdflat",  b_flat_build,  b_flat_query,  b_flat_agg,  b_flat_knn, NULL,           b_flat_remove,  b_flat_memory,  b_flat_destroy },
+    { "quad",    b_quad_build,  b_quad_query,  b_quad_agg,  NULL,       b_quad_insert,  b_quad_remove,  b_quad_memory,  b_quad_destroy },
+    { "range",   b_range_build, b_range_query, b_range_agg, NULL,       b_range_insert, b_range_remove, b_range_memory, b_range_destroy },
+    { "rtree",   b_rtree_build, b_rtree_query, b_rtree_agg, NULL,       b_rtree_insert, b_rtree_remove, b_rtree_memory, b_rtree_destroy },
+};
+#define NUM_BENCH_INDEXES ((int)(sizeof(bench_indexes) / sizeof(bench_indexes[0])))
+
+// Exact kNN for indexes without one: grow a box (half-width r in distance
+// units) until it holds k movies, then widen it once to the k-th distance
+int knn_box_search(BenchIndex *ix, int target, int k, Neighbor *out, int *buf) {
+    double diag = 0.0;
+    for(int d=0; d<k_dims; d++) diag += pow((gen_hi[dim_field[d]] - gen_lo[dim_field[d]]) / dim_scale(d), 2);
+    diag = sqrt(diag);
+    double r = 0.01 * diag;
+    while (1) {
+        double min[MAX_DIMS], max[MAX_DIMS];
+        for(int d=0; d<k_dims; d++) {
+            min[d] = db.col[d][target] - r * dim_scale(d);
+            max[d] = db.col[d][target] + r * dim_scale(d);
+        }
+        int cnt = 0, m = 0;
+        ix->query(min, max, buf, &cnt);
+        for(int i=0; i<cnt; i++) if (buf[i] != target) buf[m++] = buf[i];
+        if (m >= k || r > 4.0 * diag) {
+            int found = run_knn(target, buf, m, k, out);
+            if (found < k || out[found - 1].dist <= r) return found;
+            r = out[found - 1].dist;
+        } else r *= 2.0;
+    }
+}
+
+int live_count() {
+    int live = 0;
+    for(int i=0; i<db.count; i++) live += !db.deleted[i];
+    return live;
+}
+
+// --- Workloads ---
+int trials = 3, nqueries = 200, knn_k = 10;
+const double selectivities[] = { 0.0001, 0.001, 0.01, 0.1 };
+#define NUM_SELECTIVITIES ((int)(sizeof(selectivities) / sizeof(selectivities[0])))
+
+void bench_range_queries(BenchIndex *ix, int *res, const char *tag) {
+    Samples s = {0};
+    for(int j=0; j<NUM_SELECTIVITIES; j++) {
+        long hits = 0;
+        for(int t=0; t<trials; t++) {
+            for(int q=0; q<nqueries; q++) {
+                double min[MAX_DIMS], max[MAX_DIMS];
+                selectivity_box(selectivities[j], box_scale[j], min, max);
+                int cnt = 0;
+                double t0 = wall_time();
+                ix->query(min, max, res, &cnt);
+                sample_add(&s, wall_time() - t0);
+                hits += cnt;
+            }
+        }
+        char param[32];
+        snprintf(param, sizeof(param), "%s%g", tag, selectivities[j]);
+        report(ix->name, "range", param, &s, (double)hits / ((double)trials * nqueries * db.count));
+    }
+    free(s.v);
+}
+
+// Boxes of the range workload's selectivities, answered from the subtree
+// aggregates; the first trial also checks each count against query()
+void bench_aggregates(BenchIndex *ix, int *res) {
+    Samples s = {0};
+    for(int j=0; j<NUM_SELECTIVITIES; j++) {
+        int agree = 0;
+        for(int t=0; t<trials; t++) {
+            for(int q=0; q<nqueries; q++) {
+                double min[MAX_DIMS], max[MAX_DIMS];
+                selectivity_box(selectivities[j], box_scale[j], min, max);
+                Agg agg;
+                double t0 = wall_time();
+                ix->aggregate(min, max, &agg);
+                sample_add(&s, wall_time() - t0);
+                if (t == 0) {
+                    int cnt = 0;
+                    ix->query(min, max, res, &cnt);
+                    agree += cnt == agg.count;
+                }
+            }
+        }
+        char param[32];
+        snprintf(param, sizeof(param), "%g", selectivities[j]);
+        report(ix->name, "aggregate", param, &s, (double)agree / nqueries);
+    }
+    free(s.v);
+}
+
+void bench_index(BenchIndex *ix, int n) {
+    int *ids = malloc(n * sizeof(int));
+    int *res = malloc(2 * n * sizeof(int));
+    Samples s = {0};
+    char param[32];
+    memset(db.deleted, 0, db.count);
+    rng_state = RNG_SEED ^ 0xD1B54A32D192ED03ull; // Same targets, victims and moves for every index
+
+    // Build, keeping the last one for the other workloads
+    for(int t=0; t<trials; t++) {
+        if (t > 0) ix->destroy();
+        for(int i=0; i<n; i++) ids[i] = i;
+        double t0 = wall_time();
+        ix->build(ids, n);
+        sample_add(&s, wall_time() - t0);
+    }
+    report(ix->name, "build", "", &s, 0.0);
+    report(ix->name, "memory", "", NULL, (double)ix->memory());
+
+    bench_range_queries(ix, res, "");
+    bench_aggregates(ix, res);
+
+    for(int t=0; t<trials; t++) {
+        for(int q=0; q<nqueries; q++) {
+            Neighbor nn[64];
+            int target = (int)(rng_next() % n);
+            double t0 = wall_time();
+            if (ix->knn) ix->knn(target, knn_k, nn);
+            else knn_box_search(ix, target, knn_k, nn, res);
+            sample_add(&s, wall_time() - t0);
+        }
+    }
+    snprintf(param, sizeof(param), "k=%d%s", knn_k, ix->knn ? "" : ":box");
+    report(ix->name, "knn", param, &s, 0.0);
+
+    // Insert/delete mix: rebuild on 90% of the catalog, then alternate
+    // inserting the rest with deleting random live movies. Static layouts
+    // keep the whole catalog and only delete.
+    if (ix->insert || ix->remove) {
+        int m = ix->insert ? n - n / 10 : n;
+        ix->destroy();
+        for(int i=0; i<m; i++) ids[i] = i;
+        ix->build(ids, m);
+        Samples del = {0};
+        for(int next = m; next < m + n / 10; next++) {
+            double t0;
+            if (ix->insert) {
+                t0 = wall_time();
+                ix->insert(next);
+                sample_add(&s, wall_time() - t0);
+            }
+            int limit = ix->insert ? next : n;
+            int victim = (int)(rng_next() % limit);
+            while (db.deleted[victim]) victim = (victim + 1) % limit;
+            t0 = wall_time();
+            if (ix->remove) ix->remove(victim);
+            else db.deleted[victim] = 1;
+            sample_add(&del, wall_time() - t0);
+        }
+        if (ix->insert) report(ix->name, "insert", "mix", &s, 0.0);
+        report(ix->name, "delete", !ix->remove ? "mix:tombstone" : ix->insert ? "mix" : "only", &del, (double)live_count() / n);
+        bench_range_queries(ix, res, "after-mix:");
+        free(del.v);
+    }
+
+    // Moves: live movies get a new dim 1 value and are relocated by a delete
+    // and an insert; the old values come back once the index is gone. Range
+    // queries run after the first tenth of the catalog has moved and again
+    // after half of it, where buffered layouts carry the most moved entries.
+    int nmoves = n / 2, *moved = malloc(nmoves * sizeof(int));
+    double *old = malloc(nmoves * sizeof(double));
+    if (ix->insert && ix->remove) {
+        int f = dim_field[1];
+        for(int i=0; i<nmoves; i++) {
+            int id = (int)(rng_next() % n);
+            while (db.deleted[id]) id = (id + 1) % n;
+            moved[i] = id;
+            old[i] = db.col[1][id];
+            double v = gen_lo[f] + rng_unit() * (gen_hi[f] - gen_lo[f]);
+            double t0 = wall_time();
+            ix->remove(id);
+            db.deleted[id] = 0;
+            store_set(id, 1, v);
+            ix->insert(id);
+            sample_add(&s, wall_time() - t0);
+            if (i + 1 == n / 10) bench_range_queries(ix, res, "after-move:");
+        }
+        report(ix->name, "move", "", &s, 0.0);
+        bench_range_queries(ix, res, "after-move-batch:");
+    }
+
+    ix->destroy();
+    if (ix->insert && ix->remove) {
+        for(int i=nmoves-1; i>=0; i--) store_set(moved[i], 1, old[i]);
+    }
+    free(moved); free(old);
+    memset(db.deleted, 0, db.count);
+    free(s.v); free(ids); free(res);
+}
+
+int main(int argc, char **argv) {
+    int n = 100000;
+    const char *dist = "both", *only = NULL, *path = NULL;
+    for(int i=1; i<argc; i++) {
+        const char *arg = argv[i], *val = (i + 1 < argc) ? argv[i + 1] : NULL;
+        if (!val && strcmp(arg, "--json") != 0) { printf("ERROR: %s needs a value.\n", arg); return 1; }
+        if (strcmp(arg, "--n") == 0) { n = atoi(val); i++; }
+        else if (strcmp(arg, "--trials") == 0) { trials = atoi(val); i++; }
+        else if (strcmp(arg, "--queries") == 0) { nqueries = atoi(val); i++; }
+        else if (strcmp(arg, "--k") == 0) { knn_k = atoi(val); i++; }
+        else if (strcmp(arg, "--dist") == 0) { dist = val; i++; }
+        else if (strcmp(arg, "--index") == 0) { only = val; i++; }
+        else if (strcmp(arg, "--out") == 0) { path = val; i++; }
+        else if (strcmp(arg, "--json") == 0) out_json = 1;
+        else {
+            printf("Usage: bench.exe [--n N] [--trials T] [--queries Q] [--k K] [--dist uniform|clustered|both]\n"
+                   "                 [--index kdtree|kdflat|quad|range|rtree] [--out FILE] [--json]\n");
+            return 1;
+        }
+    }
+    if (n < 10 || trials < 1 || nqueries < 1 || knn_k < 1 || knn_k > 64) { printf("ERROR: Invalid sizes.\n"); return 1; }
+    dims_from_env();
+
+    out = path ? fopen(path, "w") : stdout;
+    if (!out) { printf("ERROR: Cannot write %s.\n", path); return 1; }
+    if (out_json) fprintf(out, "[\n");
+    else fprintf(out, "dataset,n,index,workload,param,ops,p50_us,p99_us,mean_us,extra\n");
+
+    const char *datasets[] = { "uniform", "clustered" };
+    for(int c=0; c<2; c++) {
+        if (strcmp(dist, "both") != 0 && strcmp(dist, datasets[c]) != 0) continue;
+        cur_dataset = datasets[c];
+        cur_n = n;
+        rng_state = RNG_SEED + c; // Each dataset is the same whatever ran before it
+        gen_dataset(c, n);
+        prepare_quantiles();
+        calibrate_boxes(selectivities, NUM_SELECTIVITIES);
+        for(int i=0; i<NUM_BENCH_INDEXES; i++) {
+            if (only && strcmp(only, bench_indexes[i].name) != 0) continue;
+            bench_index(&bench_indexes[i], n);
+            fflush(out);
+        }
+    }
+    if (out_json) fprintf(out, "\n]\n");
+    if (path) fclose(out);
+    for(int d=0; d<k_dims; d++) free(sorted_col[d]);
+    store_free();
+    return 0;
+}
@@ -0,0 +1,65 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+
+// Small test client for server.exe --socket PATH. Sends the command given on
+// the command line, or every line of stdin, and prints each reply up to END.
+#ifdef _WIN32
+int main() {
+    printf("ERROR: Unix sockets are not available on this platform.\n");
+    return 1;
+}
+#else
+int send_command(FILE *in, FILE *out, const char *cmd) {
+    fprintf(out, "%s\n", cmd);
+    fflush(out);
+    char line[8192];
+    while (fgets(line, sizeof(line), in)) {
+        fputs(line, stdout);
+        if (strcmp(line, "END\n") == 0) return 1;
+    }
+    return 0; // Server closed the connection
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        printf("Usage: client.exe <socket> [command words...]\n");
+        return 1;
+    }
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, argv[1], sizeof(addr.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        printf("ERROR: Cannot connect to %s.\n", argv[1]);
+        return 1;
+    }
+    FILE *in = fdopen(fd, "r"), *out = fdopen(dup(fd), "w");
+
+    char line[8192];
+    if (argc > 2) {
+        line[0] = '\0';
+        for(int i=2; i<argc; i++) {
+            if (strlen(line) + strlen(argv[i]) + 2 > sizeof(line)) break;
+            if (i > 2) strcat(line, " ");
+            strcat(line, argv[i]);
+        }
+        send_command(in, out, line);
+    } else {
+        while (fgets(line, sizeof(line), stdin)) {
+            line[strcspn(line, "\r\n")] = '\0';
+            if (!line[strspn(line, " \t")]) continue; // The server does not answer blank lines
+            if (!send_command(in, out, line)) break;
+        }
+    }
+    fclose(in);
+    fclose(out);
+    return 0;
+}
+#endif
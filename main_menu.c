@@ -11,6 +11,8 @@ int main() {
         printf("2. Run Quad Tree\n");
         printf("3. Run Range Tree\n");
         printf("4. Run R-Tree\n");
+        printf("5. Run k-d Tree (flat, leaf buckets)\n");
+        printf("6. Start Query Server (type commands, QUIT to return)\n");
         printf("0. Exit\n");
         printf("Choice: ");
         
@@ -39,8 +41,16 @@ int main() {
         else if (choice == 4) {
              printf("\n--- Running R-Tree ---\n");
              system("tree_rtree.exe");
+        }
+        else if (choice == 5) {
+             printf("\n--- Running k-d Tree (flat) ---\n");
+             system("tree_kdtree.exe --flat");
+        }
+        else if (choice == 6) {
+             printf("\n--- Query Server (e.g. RANGE rtree 1000 50000 2 50 60 180 -inf inf -inf inf) ---\n");
+             system("server.exe");
         } else {
-             printf("Invalid choice. Please select from 0 to 4.\n");
+             printf("Invalid choice. Please select from 0 to 6.\n");
         }
     }
     return 0;
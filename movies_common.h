@@ -7,187 +7,1460 @@
 #include <math.h>
 #include <time.h>
 #include <ctype.h>
+#include <pthread.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
 
 #define MAX_LINE 8192
 #define MAX_MOVIES 200000 
 #define NUM_HASHES 20     
+#define MAX_THREADS 16
+#define TOMBSTONE_RATIO 0.25 // Removed share of a subtree that makes a delete rebuild it
 
 // --- ΡΥΘΜΙΣΗ ΔΙΑΣΤΑΣΕΩΝ ---
-// Αλλάξτε το σε 2, 3, 4 ή 5
-#define K_DIMS 5 
+// Every array is sized for MAX_DIMS; the k_dims active dimensions (2 to
+// MAX_DIMS) and the catalog field behind each are picked at startup with
+// MOVIES_DIMS, either a count ("3": the first three fields) or a list of
+// field names ("budget,revenue,runtime").
+#define MAX_DIMS 5
+
+typedef struct {
+    const char *name;
+    const char *label;       // Column heading in aggregate output
+    int csv_col;
+    double scale;            // Divides the value in distances (Budget and Revenue are in the millions)
+    double demo_lo, demo_hi; // Range of the demo box
+} DimField;
+
+const DimField dim_fields[] = {
+    { "budget",     "Budget",     8,  1000000.0, 1000, 50000 },
+    { "popularity", "Popularity", 11, 1.0,       2,    50 },
+    { "runtime",    "Runtime",    10, 1.0,       60,   180 },
+    { "vote",       "VoteAvg",    12, 1.0,       -1e9, 1e9 },
+    { "revenue",    "Revenue",    9,  1000000.0, -1e9, 1e9 },
+};
+#define NUM_DIM_FIELDS ((int)(sizeof(dim_fields) / sizeof(dim_fields[0])))
+
+int k_dims = MAX_DIMS;
+int dim_field[MAX_DIMS] = { 0, 1, 2, 3, 4 }; // dim_fields entry of each active dimension
+
+// Selects the dimensions from a MOVIES_DIMS style spec; must run before the
+// store is filled. Returns 0 (and keeps the current choice) on a bad spec.
+int dims_configure(const char *spec) {
+    int fields[MAX_DIMS], n = 0;
+    char *end;
+    long count = strtol(spec, &end, 10);
+    if (end != spec && *end == '\0') {
+        if (count < 2 || count > MAX_DIMS) return 0;
+        for (n = 0; n < count; n++) fields[n] = n;
+    } else {
+        const char *p = spec;
+        while (*p) {
+            size_t len = strcspn(p, ",");
+            int f = 0;
+            while (f < NUM_DIM_FIELDS && (strlen(dim_fields[f].name) != len || strncmp(dim_fields[f].name, p, len) != 0)) f++;
+            if (f == NUM_DIM_FIELDS || n == MAX_DIMS) return 0;
+            for (int i = 0; i < n; i++) if (fields[i] == f) return 0;
+            fields[n++] = f;
+            p += len + (p[len] == ',');
+        }
+        if (n < 2) return 0;
+    }
+    k_dims = n;
+    memcpy(dim_field, fields, n * sizeof(int));
+    return 1;
+}
+
+void dims_from_env() {
+    const char *spec = getenv("MOVIES_DIMS");
+    if (spec && *spec && !dims_configure(spec)) {
+        printf("ERROR: MOVIES_DIMS=%s is not 2-%d of:", spec, MAX_DIMS);
+        for (int f = 0; f < NUM_DIM_FIELDS; f++) printf(" %s", dim_fields[f].name);
+        printf(". Using %d dimensions.\n", k_dims);
+    }
+}
+
+// Hot loops are written once as always-inline kernels over a constant
+// dimension count D; DIMS_SWITCH instantiates the statement for every count
+// and picks the active one, so their loops over D are fully unrolled.
+#define KERNEL static inline __attribute__((always_inline))
+#define DIMS_SWITCH(...) switch (k_dims) { \
+    case 2: { enum { D = 2 }; __VA_ARGS__; } break; \
+    case 3: { enum { D = 3 }; __VA_ARGS__; } break; \
+    case 4: { enum { D = 4 }; __VA_ARGS__; } break; \
+    default: { enum { D = MAX_DIMS }; __VA_ARGS__; } break; }
 
 // --- DOMES ---
+// Cold record: only read when a result is printed or compared by text
 typedef struct {
     int id;
     char title[250];
-    // values[0]: Budget
-    // values[1]: Popularity
-    // values[2]: Runtime (if K>2)
-    // values[3]: Vote Average (if K>3)
-    // values[4]: Revenue (if K>4)
-    double values[K_DIMS]; 
-
     char text_feature[600]; 
     unsigned int minhash_sig[NUM_HASHES];
-    int is_deleted; 
 } Movie;
 
+// Hot/cold split: the coordinates and the tombstone live in contiguous
+// per-dimension columns indexed by movie id, so range scans and distance
+// loops stream through doubles instead of whole Movie records.
+// col[d] holds dim_fields[dim_field[d]]; by default Budget, Popularity,
+// Runtime, Vote Average and Revenue in that order.
+// norm[d] is col[d] in distance units (divided by dim_scale once, when the
+// value is stored); for unscaled dimensions it is the same array as col[d].
+typedef struct {
+    double *col[MAX_DIMS];
+    double *norm[MAX_DIMS];
+    unsigned char *deleted;
+    Movie *info;
+    int count, capacity;
+    int mapped; // Arrays point into a snapshot mapping (see snap_open)
+} MovieStore;
+
+MovieStore db;
+
 typedef struct {
-    Movie *movie;
+    int id;
     double dist;
 } Neighbor;
 
+double dim_scale(int i) {
+    return dim_fields[dim_field[i]].scale;
+}
+
+void store_init(int capacity) {
+    if (capacity < 1) capacity = 1;
+    for(int d=0; d<k_dims; d++) {
+        db.col[d] = malloc(capacity * sizeof(double));
+        db.norm[d] = (dim_scale(d) != 1.0) ? malloc(capacity * sizeof(double)) : db.col[d];
+    }
+    db.deleted = malloc(capacity);
+    db.info = malloc(capacity * sizeof(Movie));
+    db.count = 0;
+    db.capacity = capacity;
+}
+
+// A mapped store is released with its snapshot, not here
+void store_free() {
+    if (!db.mapped) {
+        for(int d=0; d<k_dims; d++) {
+            if (db.norm[d] != db.col[d]) free(db.norm[d]);
+            free(db.col[d]);
+        }
+        free(db.deleted);
+        free(db.info);
+    }
+    memset(&db, 0, sizeof(db));
+}
+
+// Copies a mapped store to the heap (at the current capacity) so it can grow
+void store_detach() {
+    for(int d=0; d<k_dims; d++) {
+        double *c = malloc(db.capacity * sizeof(double));
+        memcpy(c, db.col[d], db.count * sizeof(double));
+        if (db.norm[d] != db.col[d]) {
+            db.norm[d] = memcpy(malloc(db.capacity * sizeof(double)), db.norm[d], db.count * sizeof(double));
+        } else db.norm[d] = c;
+        db.col[d] = c;
+    }
+    db.deleted = memcpy(malloc(db.capacity), db.deleted, db.count);
+    db.info = memcpy(malloc(db.capacity * sizeof(Movie)), db.info, db.count * sizeof(Movie));
+    db.mapped = 0;
+}
+
+// Sets one coordinate and keeps its scaled copy in step
+void store_set(int id, int d, double v) {
+    db.col[d][id] = v;
+    if (db.norm[d] != db.col[d]) db.norm[d][id] = v / dim_scale(d);
+}
+
+// Appends a movie with the given coordinates and returns its id
+int store_add(double vals[]) {
+    if (db.count == db.capacity && db.mapped) {
+        db.capacity *= 2;
+        store_detach();
+    } else if (db.count == db.capacity) {
+        db.capacity *= 2;
+        for(int d=0; d<k_dims; d++) {
+            int alias = (db.norm[d] == db.col[d]);
+            db.col[d] = realloc(db.col[d], db.capacity * sizeof(double));
+            db.norm[d] = alias ? db.col[d] : realloc(db.norm[d], db.capacity * sizeof(double));
+        }
+        db.deleted = realloc(db.deleted, db.capacity);
+        db.info = realloc(db.info, db.capacity * sizeof(Movie));
+    }
+    int id = db.count++;
+    for(int d=0; d<k_dims; d++) store_set(id, d, vals[d]);
+    db.deleted[id] = 0;
+    db.info[id].id = id;
+    return id;
+}
+
+// --- ARENA ALLOCATOR ---
+// Index nodes are carved from large blocks instead of one malloc each, so they
+// sit close together in memory and a whole index is dropped by freeing its
+// few blocks. Nodes released early (splits, deletes) go to per-size free lists.
+#define ARENA_BLOCK (1 << 20)
+#define ARENA_ALIGN 16
+#define ARENA_CLASSES 64 // Free lists for sizes up to ARENA_CLASSES * ARENA_ALIGN
+
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;
+    size_t used, size;
+} ArenaBlock;
+
+#define ARENA_HDR ((sizeof(ArenaBlock) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+typedef struct {
+    ArenaBlock *head;
+    void *free_list[ARENA_CLASSES];
+} Arena;
+
+ArenaBlock *arena_new_block(size_t size) {
+    ArenaBlock *b = malloc(ARENA_HDR + size);
+    b->next = NULL; b->used = 0; b->size = size;
+    return b;
+}
+
+void *arena_alloc(Arena *a, size_t size) {
+    if (size == 0) size = 1;
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    size_t cls = size / ARENA_ALIGN - 1;
+    if (cls < ARENA_CLASSES && a->free_list[cls]) {
+        void *p = a->free_list[cls];
+        a->free_list[cls] = *(void**)p;
+        return p;
+    }
+    if (size > ARENA_BLOCK / 4) {
+        // Large arrays get a block of their own, linked behind the current one
+        ArenaBlock *b = arena_new_block(size);
+        b->used = size;
+        if (a->head) { b->next = a->head->next; a->head->next = b; }
+        else a->head = b;
+        return (char*)b + ARENA_HDR;
+    }
+    if (!a->head || a->head->used + size > a->head->size) {
+        ArenaBlock *b = arena_new_block(ARENA_BLOCK);
+        b->next = a->head;
+        a->head = b;
+    }
+    void *p = (char*)a->head + ARENA_HDR + a->head->used;
+    a->head->used += size;
+    return p;
+}
+
+// Makes p (allocated with this size) reusable by the next arena_alloc of that size
+void arena_release(Arena *a, void *p, size_t size) {
+    if (!p) return;
+    if (size == 0) size = 1;
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    size_t cls = size / ARENA_ALIGN - 1;
+    if (cls >= ARENA_CLASSES) return; // Reclaimed by arena_free
+    *(void**)p = a->free_list[cls];
+    a->free_list[cls] = p;
+}
+
+void *arena_realloc(Arena *a, void *p, size_t old_size, size_t size) {
+    void *q = arena_alloc(a, size);
+    if (p) {
+        memcpy(q, p, old_size < size ? old_size : size);
+        arena_release(a, p, old_size);
+    }
+    return q;
+}
+
+void arena_free(Arena *a) {
+    ArenaBlock *b = a->head;
+    while (b) {
+        ArenaBlock *next = b->next;
+        free(b);
+        b = next;
+    }
+    memset(a, 0, sizeof(*a));
+}
+
 // --- MINHASH FUNCTIONS ---
-unsigned int hash_str(const char *str, int seed) {
-    unsigned int hash = 5381 + seed;
-    int c;
-    while ((c = *str++)) hash = ((hash << 5) + hash) + c;
+// Every token is hashed once; the NUM_HASHES signature rows are derived from
+// that value with the universal permutations h_i(x) = a_i * x + b_i (mod 2^32,
+// a_i odd) followed by an xorshift, eight (AVX2) or four (SSE4.1) rows at once.
+#define MINHASH_LANES ((NUM_HASHES + 7) & ~7)
+
+unsigned int minhash_a[MINHASH_LANES], minhash_b[MINHASH_LANES];
+
+// djb2 over the token, finished with the murmur3 mixer so all bits avalanche
+unsigned int hash_str(const char *str, size_t len) {
+    unsigned int hash = 5381;
+    for (size_t i = 0; i < len; i++) hash = ((hash << 5) + hash) + (unsigned char)str[i];
+    hash ^= hash >> 16; hash *= 0x85ebca6bu;
+    hash ^= hash >> 13; hash *= 0xc2b2ae35u;
+    hash ^= hash >> 16;
     return hash;
 }
 
-void compute_minhash(Movie *m) {
-    char temp[600];
-    strncpy(temp, m->text_feature, 599);
-    temp[599] = '\0';
-    for(int i=0; i<NUM_HASHES; i++) m->minhash_sig[i] = 0xFFFFFFFF;
-    
-    char *token = strtok(temp, " ,.-|:;'[]\"");
-    while (token != NULL) {
-        if (strlen(token) > 2) { 
-            for (int i = 0; i < NUM_HASHES; i++) {
-                unsigned int h = hash_str(token, i * 98765); 
-                if (h < m->minhash_sig[i]) m->minhash_sig[i] = h;
-            }
+void minhash_rows_scalar(unsigned int x, unsigned int *mins) {
+    for (int i = 0; i < MINHASH_LANES; i++) {
+        unsigned int h = minhash_a[i] * x + minhash_b[i];
+        h ^= h >> 16;
+        if (h < mins[i]) mins[i] = h;
+    }
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("sse4.1")))
+void minhash_rows_sse41(unsigned int x, unsigned int *mins) {
+    __m128i vx = _mm_set1_epi32((int)x);
+    for (int i = 0; i < MINHASH_LANES; i += 4) {
+        __m128i h = _mm_add_epi32(_mm_mullo_epi32(_mm_loadu_si128((const __m128i*)(minhash_a + i)), vx),
+                                  _mm_loadu_si128((const __m128i*)(minhash_b + i)));
+        h = _mm_xor_si128(h, _mm_srli_epi32(h, 16));
+        __m128i *m = (__m128i*)(mins + i);
+        _mm_storeu_si128(m, _mm_min_epu32(_mm_loadu_si128(m), h));
+    }
+}
+
+__attribute__((target("avx2")))
+void minhash_rows_avx2(unsigned int x, unsigned int *mins) {
+    __m256i vx = _mm256_set1_epi32((int)x);
+    for (int i = 0; i < MINHASH_LANES; i += 8) {
+        __m256i h = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_loadu_si256((const __m256i*)(minhash_a + i)), vx),
+                                     _mm256_loadu_si256((const __m256i*)(minhash_b + i)));
+        h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 16));
+        __m256i *m = (__m256i*)(mins + i);
+        _mm256_storeu_si256(m, _mm256_min_epu32(_mm256_loadu_si256(m), h));
+    }
+}
+#endif
+
+void (*minhash_rows)(unsigned int, unsigned int*) = NULL;
+
+// Fixed coefficients (splitmix32 sequence) and kernel choice; the loader calls
+// this before starting its threads
+void minhash_init() {
+    if (minhash_rows) return;
+    unsigned int state = 0x9e3779b9u;
+    for (int i = 0; i < MINHASH_LANES; i++) {
+        for (int j = 0; j < 2; j++) {
+            unsigned int z = (state += 0x9e3779b9u);
+            z = (z ^ (z >> 16)) * 0x85ebca6bu;
+            z = (z ^ (z >> 13)) * 0xc2b2ae35u;
+            z ^= z >> 16;
+            if (j == 0) minhash_a[i] = z | 1u; else minhash_b[i] = z;
         }
-        token = strtok(NULL, " ,.-|:;'[]\"");
     }
+    minhash_rows = minhash_rows_scalar;
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) minhash_rows = minhash_rows_avx2;
+    else if (__builtin_cpu_supports("sse4.1")) minhash_rows = minhash_rows_sse41;
+#endif
+}
+
+// Tokenizes with strspn/strcspn instead of strtok, which keeps hidden global
+// state and would race when signatures are computed by several loader threads
+void compute_minhash(Movie *m) {
+    const char *delim = " ,.-|:;'[]\"";
+    unsigned int mins[MINHASH_LANES];
+    minhash_init();
+    for(int i=0; i<MINHASH_LANES; i++) mins[i] = 0xFFFFFFFF;
+
+    const char *token = m->text_feature + strspn(m->text_feature, delim);
+    while (*token) {
+        size_t len = strcspn(token, delim);
+        if (len > 2) minhash_rows(hash_str(token, len), mins);
+        token += len;
+        token += strspn(token, delim);
+    }
+    memcpy(m->minhash_sig, mins, sizeof(m->minhash_sig));
 }
 
-double jaccard_similarity(Movie *m1, Movie *m2) {
-    int matches = 0;
-    for (int i = 0; i < NUM_HASHES; i++) {
-        if (m1->minhash_sig[i] == m2->minhash_sig[i]) matches++;
+// Fraction of equal signature rows: four rows per SSE2 compare, counted
+// from the compare mask with a popcount
+double jaccard_similarity(int a, int b) {
+    const unsigned int *s1 = db.info[a].minhash_sig, *s2 = db.info[b].minhash_sig;
+    int matches = 0, i = 0;
+#ifdef __SSE2__
+    for (; i + 4 <= NUM_HASHES; i += 4) {
+        __m128i eq = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*)(s1 + i)),
+                                     _mm_loadu_si128((const __m128i*)(s2 + i)));
+        matches += __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(eq)));
+    }
+#endif
+    for (; i < NUM_HASHES; i++) {
+        if (s1[i] == s2[i]) matches++;
     }
     return (double)matches / NUM_HASHES;
 }
 
+// --- LSH INDEX (MinHash banding) ---
+// Each signature is cut into LSH_BANDS bands of LSH_ROWS rows and every band is
+// hashed into its own bucket table, so a query only visits movies that share
+// at least one whole band with the target.
+#define LSH_BANDS 5
+#define LSH_ROWS (NUM_HASHES / LSH_BANDS)
+#define LSH_SHOW 20
+
+typedef struct {
+    int *head[LSH_BANDS]; // bucket -> first id, -1 if empty
+    int *next[LSH_BANDS]; // id -> next id in the same bucket
+    int *mark;            // id -> stamp of the last query that reported it
+    int stamp, nbuckets, size;
+} LshIndex;
+
+unsigned int lsh_band_hash(int id, int band) {
+    unsigned int *sig = db.info[id].minhash_sig + band * LSH_ROWS;
+    unsigned int h = 2166136261u; // FNV-1a over the band's rows
+    for (int r = 0; r < LSH_ROWS; r++) { h ^= sig[r]; h *= 16777619u; }
+    return h;
+}
+
+int lsh_band_equal(int a, int b, int band) {
+    return memcmp(db.info[a].minhash_sig + band * LSH_ROWS,
+                  db.info[b].minhash_sig + band * LSH_ROWS, LSH_ROWS * sizeof(unsigned int)) == 0;
+}
+
+// Indexes ids 0..n-1 of the store
+void lsh_build(LshIndex *idx, int n) {
+    idx->nbuckets = 1;
+    while (idx->nbuckets < 2 * n) idx->nbuckets <<= 1;
+    idx->size = n;
+    idx->stamp = 0;
+    idx->mark = calloc(n > 0 ? n : 1, sizeof(int));
+    for (int b = 0; b < LSH_BANDS; b++) {
+        idx->head[b] = malloc(idx->nbuckets * sizeof(int));
+        idx->next[b] = malloc((n > 0 ? n : 1) * sizeof(int));
+        for (int i = 0; i < idx->nbuckets; i++) idx->head[b][i] = -1;
+        for (int id = 0; id < n; id++) {
+            unsigned int slot = lsh_band_hash(id, b) & (idx->nbuckets - 1);
+            idx->next[b][id] = idx->head[b][slot];
+            idx->head[b][slot] = id;
+        }
+    }
+}
+
+void lsh_free(LshIndex *idx) {
+    for (int b = 0; b < LSH_BANDS; b++) { free(idx->head[b]); free(idx->next[b]); }
+    free(idx->mark);
+}
+
+// Writes every live movie sharing at least one band with target into out[]
+// (capacity idx->size) and returns how many there are
+int lsh_query(LshIndex *idx, int target, int *out) {
+    int n = 0;
+    idx->stamp++;
+    for (int b = 0; b < LSH_BANDS; b++) {
+        unsigned int slot = lsh_band_hash(target, b) & (idx->nbuckets - 1);
+        for (int id = idx->head[b][slot]; id != -1; id = idx->next[b][id]) {
+            if (id == target || idx->mark[id] == idx->stamp || db.deleted[id]) continue;
+            if (!lsh_band_equal(id, target, b)) continue; // slot clash, different band
+            idx->mark[id] = idx->stamp;
+            out[n++] = id;
+        }
+    }
+    return n;
+}
+
+void print_lsh_similar(LshIndex *idx, int target, double min_sim) {
+    printf("\n[LSH Similarity - Banding] Target: %s\n", db.info[target].title);
+    printf("(Showing candidates that collide in at least 1 band)\n");
+    int *cand = malloc((idx->size > 0 ? idx->size : 1) * sizeof(int));
+    int nc = lsh_query(idx, target, cand);
+    int found_sim = 0;
+    for (int i = 0; i < nc; i++) {
+        double sim = jaccard_similarity(target, cand[i]);
+        if (sim > min_sim) {
+            if (found_sim < LSH_SHOW) printf(" -> Candidate: %s (Jaccard: %.2f)\n", db.info[cand[i]].title, sim);
+            found_sim++;
+        }
+    }
+    if (found_sim > LSH_SHOW) printf(" ... and %d more\n", found_sim - LSH_SHOW);
+    if (found_sim == 0) printf("No similar text features found.\n");
+    free(cand);
+}
+
 // --- kNN & DISTANCE FUNCTIONS ---
-double euclidean_dist(Movie *m1, Movie *m2) {
+KERNEL double euclidean_dist_k(const int D, int a, int b) {
     double sum = 0.0;
-    for (int i = 0; i < K_DIMS; i++) {
-        double diff = m1->values[i] - m2->values[i];
-        if (i == 0 || (K_DIMS > 4 && i == 4)) diff /= 1000000.0; // Scaling for large numbers
+    for (int i = 0; i < D; i++) {
+        double diff = db.norm[i][a] - db.norm[i][b];
         sum += diff * diff;
     }
     return sqrt(sum);
 }
 
-int cmp_neighbor(const void *a, const void *b) {
-    double d1 = ((Neighbor*)a)->dist;
-    double d2 = ((Neighbor*)b)->dist;
-    return (d1 > d2) - (d1 < d2);
+KERNEL double euclidean_dist(int a, int b) {
+    DIMS_SWITCH(return euclidean_dist_k(D, a, b));
 }
 
-void run_knn(Movie *target, Movie **candidates, int count, int k) {
-    if (count == 0) return;
-    Neighbor *neighbors = malloc(count * sizeof(Neighbor));
-    
-    for(int i=0; i<count; i++) {
-        neighbors[i].movie = candidates[i];
-        neighbors[i].dist = euclidean_dist(target, candidates[i]);
+// --- BATCHED DISTANCES ---
+// dist_batch(target, ids, n, out) sets out[i] to euclidean_dist(target, ids[i]).
+// The candidates' scaled coordinates are gathered from db.norm and processed
+// four (AVX2) or two (SSE2) at a time; the best kernel is picked on first use.
+KERNEL void dist_batch_scalar_k(const int D, int target, const int *ids, int n, double *out) {
+    for (int i = 0; i < n; i++) out[i] = euclidean_dist_k(D, target, ids[i]);
+}
+
+void dist_batch_scalar(int target, const int *ids, int n, double *out) {
+    DIMS_SWITCH(dist_batch_scalar_k(D, target, ids, n, out));
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("sse2"))) KERNEL
+void dist_batch_sse2_k(const int D, int target, const int *ids, int n, double *out) {
+    int i = 0;
+    for (; i + 2 <= n; i += 2) {
+        __m128d sum = _mm_setzero_pd();
+        for (int d = 0; d < D; d++) {
+            const double *c = db.norm[d];
+            __m128d v = _mm_set_pd(c[ids[i + 1]], c[ids[i]]);
+            __m128d diff = _mm_sub_pd(v, _mm_set1_pd(c[target]));
+            sum = _mm_add_pd(sum, _mm_mul_pd(diff, diff));
+        }
+        _mm_storeu_pd(out + i, _mm_sqrt_pd(sum));
     }
-    
-    qsort(neighbors, count, sizeof(Neighbor), cmp_neighbor);
-    
-    printf("\n[kNN Search] Top %d Nearest Neighbors (Numeric Space) for '%s':\n", k, target->title);
-    for(int i=0; i<k && i<count; i++) {
-        if (neighbors[i].dist >= 0) { 
-            printf(" %d. %s (Dist: %.2f)\n", i+1, neighbors[i].movie->title, neighbors[i].dist);
+    dist_batch_scalar_k(D, target, ids + i, n - i, out + i);
+}
+
+__attribute__((target("sse2")))
+void dist_batch_sse2(int target, const int *ids, int n, double *out) {
+    DIMS_SWITCH(dist_batch_sse2_k(D, target, ids, n, out));
+}
+
+__attribute__((target("avx2"))) KERNEL
+void dist_batch_avx2_k(const int D, int target, const int *ids, int n, double *out) {
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i idx = _mm_loadu_si128((const __m128i*)(ids + i));
+        __m256d sum = _mm256_setzero_pd();
+        for (int d = 0; d < D; d++) {
+            const double *c = db.norm[d];
+            __m256d v = _mm256_i32gather_pd(c, idx, 8);
+            __m256d diff = _mm256_sub_pd(v, _mm256_set1_pd(c[target]));
+            sum = _mm256_add_pd(sum, _mm256_mul_pd(diff, diff));
+        }
+        _mm256_storeu_pd(out + i, _mm256_sqrt_pd(sum));
+    }
+    dist_batch_sse2_k(D, target, ids + i, n - i, out + i);
+}
+
+__attribute__((target("avx2")))
+void dist_batch_avx2(int target, const int *ids, int n, double *out) {
+    DIMS_SWITCH(dist_batch_avx2_k(D, target, ids, n, out));
+}
+#endif
+
+void (*dist_batch_kernel)(int, const int*, int, double*) = NULL;
+
+void dist_batch(int target, const int *ids, int n, double *out) {
+    if (!dist_batch_kernel) {
+        dist_batch_kernel = dist_batch_scalar;
+#ifdef HAVE_X86_SIMD
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) dist_batch_kernel = dist_batch_avx2;
+        else if (__builtin_cpu_supports("sse2")) dist_batch_kernel = dist_batch_sse2;
+#endif
+    }
+    dist_batch_kernel(target, ids, n, out);
+}
+
+// --- BOUNDED TOP-k (fixed-size max-heap) ---
+// The root holds the current k-th best, so a candidate is rejected in O(1)
+// and accepted in O(log k). Storage is caller-owned, no allocation per query.
+typedef struct {
+    Neighbor *items;
+    int size, k;
+} KnnHeap;
+
+void knn_heap_init(KnnHeap *h, Neighbor *buf, int k) {
+    h->items = buf; h->size = 0; h->k = k;
+}
+
+// Distance a candidate must beat to enter the heap
+double knn_heap_bound(KnnHeap *h) {
+    return (h->size < h->k) ? INFINITY : h->items[0].dist;
+}
+
+void knn_heap_sift_down(Neighbor *a, int n, int i) {
+    while (1) {
+        int l = 2 * i + 1, r = l + 1, big = i;
+        if (l < n && a[l].dist > a[big].dist) big = l;
+        if (r < n && a[r].dist > a[big].dist) big = r;
+        if (big == i) return;
+        Neighbor t = a[i]; a[i] = a[big]; a[big] = t;
+        i = big;
+    }
+}
+
+void knn_heap_push(KnnHeap *h, int id, double dist) {
+    if (h->k <= 0) return;
+    if (h->size < h->k) {
+        int i = h->size++;
+        while (i > 0 && h->items[(i - 1) / 2].dist < dist) {
+            h->items[i] = h->items[(i - 1) / 2];
+            i = (i - 1) / 2;
         }
+        h->items[i].id = id; h->items[i].dist = dist;
+    } else if (dist < h->items[0].dist) {
+        h->items[0].id = id; h->items[0].dist = dist;
+        knn_heap_sift_down(h->items, h->size, 0);
     }
-    free(neighbors);
+}
+
+// Heapsorts the buffer in place (closest first) and returns the entry count
+int knn_heap_finish(KnnHeap *h) {
+    for (int end = h->size - 1; end > 0; end--) {
+        Neighbor t = h->items[0]; h->items[0] = h->items[end]; h->items[end] = t;
+        knn_heap_sift_down(h->items, end, 0);
+    }
+    return h->size;
+}
+
+// Pushes a block of candidates into the heap, distances computed in one batch
+#define DIST_BLOCK 256
+void knn_push_batch(KnnHeap *h, int target, const int *ids, int n) {
+    double dist[DIST_BLOCK];
+    for (int base = 0; base < n; base += DIST_BLOCK) {
+        int m = (n - base < DIST_BLOCK) ? n - base : DIST_BLOCK;
+        dist_batch(target, ids + base, m, dist);
+        for (int i = 0; i < m; i++) {
+            if (dist[i] < knn_heap_bound(h)) knn_heap_push(h, ids[base + i], dist[i]);
+        }
+    }
+}
+
+// Fills out[] (size k) with the k closest candidates, closest first
+int run_knn(int target, int *candidates, int count, int k, Neighbor *out) {
+    KnnHeap h;
+    knn_heap_init(&h, out, k);
+    knn_push_batch(&h, target, candidates, count);
+    return knn_heap_finish(&h);
+}
+
+void print_neighbors(const char *label, int target, Neighbor *nn, int n) {
+    printf("\n[%s] Top %d Nearest Neighbors (Numeric Space) for '%s':\n", label, n, db.info[target].title);
+    for(int i=0; i<n; i++) printf(" %d. %s (Dist: %.2f)\n", i+1, db.info[nn[i].id].title, nn[i].dist);
 }
 
 // --- CSV LOADING ---
-double parse_european_double(char *str) {
-    if (!str) return 0.0;
+// The CSV column of each dimension comes from dim_fields. Rows are accepted on
+// their budget whether or not it is one of the active dimensions.
+#define CSV_BUDGET_COL 8
+#define CSV_TITLE_COL 1
+#define CSV_GENRES_COL 6
+
+// Thread count for the loader and parallel queries; MOVIES_THREADS overrides it
+int cpu_count() {
+    const char *force = getenv("MOVIES_THREADS");
+    if (force && atoi(force) > 0) return atoi(force) > MAX_THREADS ? MAX_THREADS : atoi(force);
+#ifdef _WIN32
+    const char *env = getenv("NUMBER_OF_PROCESSORS");
+    int n = env ? atoi(env) : 1;
+#else
+    int n = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    if (n < 1) n = 1;
+    return n > MAX_THREADS ? MAX_THREADS : n;
+}
+
+double parse_european_double(const char *str, int len) {
+    if (!str || len <= 0) return 0.0;
     char temp[100];
-    strncpy(temp, str, 99);
-    temp[99] = '\0';
+    if (len > 99) len = 99;
+    memcpy(temp, str, len);
+    temp[len] = '\0';
     for(int i=0; temp[i]; i++) if(temp[i] == ',') temp[i] = '.';
     return atof(temp);
 }
 
-void get_csv_field(char *line, int index, char *output) {
-    char *ptr = line;
-    int cur_col = 0;
-    output[0] = '\0';
-    while (*ptr && cur_col < index) {
-        if (*ptr == ';' || *ptr == ',') cur_col++;
-        ptr++;
+// One accepted CSV line; the strings point into the mapped file
+typedef struct {
+    double vals[MAX_DIMS], budget;
+    const char *title, *genres;
+    int title_len, genres_len;
+} CsvRow;
+
+// A newline-aligned slice of the file, parsed by one thread
+typedef struct {
+    const char *begin, *end;
+    CsvRow *rows;
+    int count, cap;
+    int base, limit; // first store id and how many rows fit under MAX_MOVIES
+} CsvChunk;
+
+// Pass 1: walks each line once, keeping only the columns we need
+void *csv_parse_chunk(void *arg) {
+    CsvChunk *c = arg;
+    const char *p = c->begin, *end = c->end;
+    c->count = 0;
+    c->cap = (int)((end - p) / 64) + 16;
+    c->rows = malloc(c->cap * sizeof(CsvRow));
+
+    while (p < end) {
+        CsvRow row;
+        int has_budget = 0;
+        memset(&row, 0, sizeof(row));
+        for (int col = 0; ; col++) {
+            const char *f = p;
+            while (p < end && *p != ';' && *p != ',' && *p != '\n' && *p != '\r') p++;
+            int len = (int)(p - f);
+            if (col == CSV_TITLE_COL) { row.title = f; row.title_len = len; }
+            else if (col == CSV_GENRES_COL) { row.genres = f; row.genres_len = len; }
+            if (col == CSV_BUDGET_COL) { row.budget = parse_european_double(f, len); has_budget = (len > 0); }
+            for (int d = 0; d < k_dims; d++) {
+                if (dim_fields[dim_field[d]].csv_col == col) row.vals[d] = parse_european_double(f, len);
+            }
+            if (p < end && (*p == ';' || *p == ',')) p++;
+            else break;
+        }
+        while (p < end && *p != '\n') p++;
+        p++;
+
+        double b = row.budget;
+        if (has_budget && (b > 100 || b == 0)) {
+            if (c->count == c->cap) {
+                c->cap *= 2;
+                c->rows = realloc(c->rows, c->cap * sizeof(CsvRow));
+            }
+            c->rows[c->count++] = row;
+        }
     }
-    if (*ptr == '\0' || *ptr == '\n' || *ptr == '\r') return;
-    int i = 0;
-    while (*ptr && *ptr != ';' && *ptr != ',' && *ptr != '\n' && *ptr != '\r') {
-        output[i++] = *ptr++;
+    return NULL;
+}
+
+// Pass 2: copies the rows into their final store slots and computes signatures
+void *csv_store_chunk(void *arg) {
+    CsvChunk *c = arg;
+    for (int i = 0; i < c->limit; i++) {
+        CsvRow *row = &c->rows[i];
+        int id = c->base + i;
+        for (int d = 0; d < k_dims; d++) store_set(id, d, row->vals[d]);
+        db.deleted[id] = 0;
+
+        Movie *m = &db.info[id];
+        m->id = id;
+        if (row->title_len > 0) {
+            int len = row->title_len < 249 ? row->title_len : 249;
+            memcpy(m->title, row->title, len);
+            m->title[len] = '\0';
+        } else strcpy(m->title, "Unknown");
+
+        int len = row->genres_len < 599 ? row->genres_len : 599;
+        memcpy(m->text_feature, row->genres, len);
+        m->text_feature[len] = '\0';
+
+        compute_minhash(m);
     }
-    output[i] = '\0';
+    return NULL;
+}
+
+// Maps (or on Windows reads) the whole file, returns NULL if it cannot be opened
+char *map_file(const char *filename, long *size) {
+#ifdef _WIN32
+    FILE *file = fopen(filename, "rb");
+    if (!file) return NULL;
+    fseek(file, 0, SEEK_END);
+    *size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    char *buf = malloc(*size + 1);
+    *size = (long)fread(buf, 1, *size, file);
+    fclose(file);
+    return buf;
+#else
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) return NULL;
+    struct stat st;
+    fstat(fd, &st);
+    *size = (long)st.st_size;
+    char *buf = (*size > 0) ? mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0) : NULL;
+    close(fd);
+    if (buf == MAP_FAILED) return NULL;
+    if (buf) madvise(buf, *size, MADV_SEQUENTIAL);
+    return buf ? buf : (char*)"";
+#endif
+}
+
+void unmap_file(char *buf, long size) {
+#ifdef _WIN32
+    free(buf);
+#else
+    if (size > 0) munmap(buf, size);
+#endif
 }
 
-int load_csv(const char *filename, Movie *movies) {
-    FILE *file = fopen(filename, "r");
-    if (!file) { printf("ERROR: File %s not found.\n", filename); return 0; }
-    char line[MAX_LINE];
-    int count = 0;
-    char s_title[1024], s_genres[1024];
-    char s_vals[K_DIMS][100]; 
+// Fills the global store, returns the number of movies loaded.
+// The file is split into newline-aligned chunks that are parsed in parallel,
+// then every chunk copies its rows into place and computes signatures in parallel.
+int load_csv(const char *filename) {
+    long size = 0;
+    char *buf = map_file(filename, &size);
+    if (!buf) { store_init(1); printf("ERROR: File %s not found.\n", filename); return 0; }
     
-    printf("Loading data for %d dimensions...\n", K_DIMS);
-    fgets(line, MAX_LINE, file); // Skip Header
-
-    while (fgets(line, MAX_LINE, file) && count < MAX_MOVIES) {
-        line[strcspn(line, "\r\n")] = 0; 
-        
-        get_csv_field(line, 1, s_title);
-        get_csv_field(line, 6, s_genres);
-        get_csv_field(line, 8, s_vals[0]);  // Budget
-        get_csv_field(line, 11, s_vals[1]); // Popularity
-        
-        // Safe loading based on dimensions
-        if (K_DIMS > 2) get_csv_field(line, 10, s_vals[2]); // Runtime
-        if (K_DIMS > 3) get_csv_field(line, 12, s_vals[3]); // Vote Avg
-        if (K_DIMS > 4) get_csv_field(line, 9, s_vals[4]);  // Revenue
-
-        if (strlen(s_vals[0]) > 0) {
-            double b = parse_european_double(s_vals[0]);
-            if (b > 100 || b == 0) { 
-                movies[count].id = count;
-                movies[count].is_deleted = 0;
-                
-                movies[count].values[0] = b;
-                movies[count].values[1] = parse_european_double(s_vals[1]);
-                
-                // ΔΙΟΡΘΩΣΗ: Έλεγχος πριν γράψουμε στη μνήμη
-                if (K_DIMS > 2) movies[count].values[2] = parse_european_double(s_vals[2]);
-                if (K_DIMS > 3) movies[count].values[3] = parse_european_double(s_vals[3]);
-                if (K_DIMS > 4) movies[count].values[4] = parse_european_double(s_vals[4]);
-
-                // Initialize rest to 0 safely
-                for(int k=(K_DIMS < 2 ? 2 : K_DIMS); k<K_DIMS; k++) movies[count].values[k] = 0.0;
-
-                if (strlen(s_title) > 0) strncpy(movies[count].title, s_title, 249);
-                else strcpy(movies[count].title, "Unknown");
-                
-                if (strlen(s_genres) > 0) strncpy(movies[count].text_feature, s_genres, 599);
-                else strcpy(movies[count].text_feature, "");
-
-                compute_minhash(&movies[count]);
-                count++;
+    dims_from_env();
+    printf("Loading data for %d dimensions (", k_dims);
+    for (int d = 0; d < k_dims; d++) printf("%s%s", d ? ", " : "", dim_fields[dim_field[d]].label);
+    printf(")...\n");
+    const char *p = buf, *end = buf + size;
+    while (p < end && *p != '\n') p++; // Skip Header
+    if (p < end) p++;
+
+    int nthreads = cpu_count();
+    if (end - p < 65536) nthreads = 1;
+    CsvChunk chunks[MAX_THREADS];
+    pthread_t threads[MAX_THREADS];
+    const char *start = p;
+    for (int t = 0; t < nthreads; t++) {
+        const char *cut = (t == nthreads - 1) ? end : p + (end - p) * (t + 1) / nthreads;
+        if (cut < start) cut = start;
+        while (cut < end && cut[-1] != '\n') cut++;
+        chunks[t].begin = start;
+        chunks[t].end = cut;
+        start = cut;
+        pthread_create(&threads[t], NULL, csv_parse_chunk, &chunks[t]);
+    }
+    for (int t = 0; t < nthreads; t++) pthread_join(threads[t], NULL);
+
+    int total = 0;
+    for (int t = 0; t < nthreads; t++) {
+        chunks[t].base = total;
+        chunks[t].limit = chunks[t].count;
+        if (total + chunks[t].limit > MAX_MOVIES) chunks[t].limit = MAX_MOVIES - total;
+        total += chunks[t].limit;
+    }
+    store_init(total);
+    db.count = total;
+    minhash_init();
+    for (int t = 0; t < nthreads; t++) pthread_create(&threads[t], NULL, csv_store_chunk, &chunks[t]);
+    for (int t = 0; t < nthreads; t++) {
+        pthread_join(threads[t], NULL);
+        free(chunks[t].rows);
+    }
+    unmap_file(buf, size);
+    printf("Loaded %d movies.\n", db.count);
+    return db.count;
+}
+// --- TIMING ---
+// Wall-clock seconds; clock() would add up the CPU time of all query threads
+double wall_time() {
+#ifdef _WIN32
+    return (double)clock() / CLOCKS_PER_SEC;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+#endif
+}
+
+// --- PARALLEL RANGE QUERIES ---
+// The top levels of an index are expanded on the calling thread (matches found
+// there are reported directly) until there are about QUERY_TASKS_PER_THREAD
+// subtrees per thread. The subtrees are dealt out in contiguous runs to
+// per-worker deques; a worker pops its own tasks from the back and steals from
+// the front of the others when it runs dry. Each worker appends to its own
+// buffer and the buffers are concatenated into res at the end, so the matches
+// are the same as the sequential query but not in the same order.
+#define QUERY_TASKS_PER_THREAD 8
+
+typedef struct {
+    void *node;
+    int arg; // Per-index extra state, e.g. the range tree's cascade position
+} QueryTask;
+
+typedef struct {
+    QueryTask *items;
+    int count, cap;
+} QueryTaskList;
+
+// Runs one subtree to completion
+typedef void (*QueryTaskFn)(QueryTask *t, double min[], double max[], int *res, int *cnt);
+// Reports the task's own matches and pushes its intersecting children;
+// returns 0 when the task cannot be split further
+typedef int (*QueryExpandFn)(QueryTask *t, double min[], double max[], QueryTaskList *out, int *res, int *cnt);
+
+void task_push(QueryTaskList *l, void *node, int arg) {
+    if (l->count == l->cap) {
+        l->cap = l->cap ? 2 * l->cap : 64;
+        l->items = realloc(l->items, l->cap * sizeof(QueryTask));
+    }
+    l->items[l->count].node = node;
+    l->items[l->count].arg = arg;
+    l->count++;
+}
+
+// --- Box tests ---
+// Dimensions from `first` on; indexes that already settled the leading
+// dimensions of a candidate (the range tree's dims 0 and 1) skip them
+KERNEL int point_in_box_k(const int D, int id, const double *min, const double *max, int first) {
+    for (int d = first; d < D; d++) {
+        if (db.col[d][id] < min[d] || db.col[d][id] > max[d]) return 0;
+    }
+    return 1;
+}
+
+KERNEL int point_in_box_from(int id, const double *min, const double *max, int first) {
+    DIMS_SWITCH(return point_in_box_k(D, id, min, max, first));
+}
+
+KERNEL int point_in_box(int id, const double *min, const double *max) {
+    return point_in_box_from(id, min, max, 0);
+}
+
+// c holds the coordinates of one movie contiguously
+KERNEL int coords_in_box_k(const int D, const double *c, const double *min, const double *max) {
+    for (int d = 0; d < D; d++) {
+        if (c[d] < min[d] || c[d] > max[d]) return 0;
+    }
+    return 1;
+}
+
+KERNEL int coords_in_box(const double *c, const double *min, const double *max) {
+    DIMS_SWITCH(return coords_in_box_k(D, c, min, max));
+}
+
+KERNEL int box_overlaps_k(const int D, const double *amin, const double *amax, const double *bmin, const double *bmax) {
+    for (int d = 0; d < D; d++) {
+        if (amax[d] < bmin[d] || amin[d] > bmax[d]) return 0;
+    }
+    return 1;
+}
+
+// Box a lies within box b
+KERNEL int box_inside_k(const int D, const double *amin, const double *amax, const double *bmin, const double *bmax) {
+    for (int d = 0; d < D; d++) {
+        if (amin[d] < bmin[d] || amax[d] > bmax[d]) return 0;
+    }
+    return 1;
+}
+
+KERNEL int box_overlaps(const double *amin, const double *amax, const double *bmin, const double *bmax) {
+    DIMS_SWITCH(return box_overlaps_k(D, amin, amax, bmin, bmax));
+}
+
+typedef struct {
+    int head, tail; // Deque over QueryPool.tasks[head..tail)
+    pthread_mutex_t lock;
+    int *buf, count, cap;
+} PoolWorker;
+
+typedef struct {
+    int nthreads; // Including the calling thread, which is worker 0
+    PoolWorker w[MAX_THREADS];
+    pthread_t threads[MAX_THREADS];
+    pthread_mutex_t lock;
+    pthread_cond_t wake, idle;
+    int generation, pending;
+    QueryTask *tasks;
+    QueryTaskFn fn;
+    double *min, *max;
+} QueryPool;
+
+QueryPool qpool;
+
+int pool_next_task(int self, QueryTask *t) {
+    for (int i = 0; i < qpool.nthreads; i++) {
+        PoolWorker *w = &qpool.w[(self + i) % qpool.nthreads];
+        int found = 0;
+        pthread_mutex_lock(&w->lock);
+        if (w->head < w->tail) {
+            *t = (i == 0) ? qpool.tasks[--w->tail] : qpool.tasks[w->head++];
+            found = 1;
+        }
+        pthread_mutex_unlock(&w->lock);
+        if (found) return 1;
+    }
+    return 0;
+}
+
+void pool_drain(int self) {
+    PoolWorker *w = &qpool.w[self];
+    QueryTask t;
+    w->count = 0;
+    while (pool_next_task(self, &t)) qpool.fn(&t, qpool.min, qpool.max, w->buf, &w->count);
+}
+
+void *pool_worker(void *arg) {
+    int self = (int)(long)arg, seen = 0;
+    pthread_mutex_lock(&qpool.lock);
+    while (1) {
+        while (qpool.generation == seen) pthread_cond_wait(&qpool.wake, &qpool.lock);
+        seen = qpool.generation;
+        pthread_mutex_unlock(&qpool.lock);
+        pool_drain(self);
+        pthread_mutex_lock(&qpool.lock);
+        if (--qpool.pending == 0) pthread_cond_signal(&qpool.idle);
+    }
+    return NULL;
+}
+
+// Starts the worker threads on first use; they live until the program exits
+void query_pool_start() {
+    if (qpool.nthreads) return;
+    qpool.nthreads = cpu_count();
+    pthread_mutex_init(&qpool.lock, NULL);
+    pthread_cond_init(&qpool.wake, NULL);
+    pthread_cond_init(&qpool.idle, NULL);
+    for (int t = 0; t < qpool.nthreads; t++) {
+        pthread_mutex_init(&qpool.w[t].lock, NULL);
+        if (t > 0) pthread_create(&qpool.threads[t], NULL, pool_worker, (void*)(long)t);
+    }
+}
+
+// Appends every match below root to res, like the index's sequential query
+void query_parallel(QueryTask root, QueryExpandFn expand, QueryTaskFn fn,
+                    double min[], double max[], int *res, int *cnt) {
+    query_pool_start();
+    QueryTaskList cur = {0}, next = {0};
+    task_push(&cur, root.node, root.arg);
+    while (cur.count < qpool.nthreads * QUERY_TASKS_PER_THREAD) {
+        int split = 0;
+        next.count = 0;
+        for (int i = 0; i < cur.count; i++) {
+            if (expand(&cur.items[i], min, max, &next, res, cnt)) split = 1;
+            else task_push(&next, cur.items[i].node, cur.items[i].arg);
+        }
+        QueryTaskList t = cur; cur = next; next = t;
+        if (!split) break;
+    }
+
+    if (qpool.nthreads == 1 || cur.count < 2) {
+        for (int i = 0; i < cur.count; i++) fn(&cur.items[i], min, max, res, cnt);
+    } else {
+        qpool.tasks = cur.items;
+        qpool.fn = fn; qpool.min = min; qpool.max = max;
+        for (int t = 0; t < qpool.nthreads; t++) {
+            PoolWorker *w = &qpool.w[t];
+            w->head = (int)((long)cur.count * t / qpool.nthreads);
+            w->tail = (int)((long)cur.count * (t + 1) / qpool.nthreads);
+            if (w->cap < db.count) {
+                w->cap = db.count; // A worker may end up with every match
+                w->buf = realloc(w->buf, w->cap * sizeof(int));
             }
         }
+        pthread_mutex_lock(&qpool.lock);
+        qpool.pending = qpool.nthreads - 1;
+        qpool.generation++;
+        pthread_cond_broadcast(&qpool.wake);
+        pthread_mutex_unlock(&qpool.lock);
+
+        pool_drain(0);
+
+        pthread_mutex_lock(&qpool.lock);
+        while (qpool.pending > 0) pthread_cond_wait(&qpool.idle, &qpool.lock);
+        pthread_mutex_unlock(&qpool.lock);
+        for (int t = 0; t < qpool.nthreads; t++) {
+            memcpy(res + *cnt, qpool.w[t].buf, qpool.w[t].count * sizeof(int));
+            *cnt += qpool.w[t].count;
+        }
+    }
+    free(cur.items);
+    free(next.items);
+}
+// --- BATCHED RANGE QUERIES ---
+// A batch of boxes is pushed down an index together: every recursion level
+// keeps the list of boxes still intersecting its subtree, so the upper levels
+// are read once per batch and a box drops out as soon as it misses a subtree.
+// The active lists of the open levels live on one growable stack; indexes that
+// carry per-box state (range tree cascade positions) store int pairs in it.
+typedef struct {
+    double (*min)[MAX_DIMS], (*max)[MAX_DIMS];
+    int nboxes;
+    int **res, *cnt, *cap; // Result list of each box
+    int *stack, top, size;
+} BoxBatch;
+
+void batch_init(BoxBatch *b, double (*min)[MAX_DIMS], double (*max)[MAX_DIMS], int nboxes) {
+    b->min = min; b->max = max; b->nboxes = nboxes;
+    b->res = calloc(nboxes > 0 ? nboxes : 1, sizeof(int*));
+    b->cnt = calloc(nboxes > 0 ? nboxes : 1, sizeof(int));
+    b->cap = calloc(nboxes > 0 ? nboxes : 1, sizeof(int));
+    b->size = 4 * (nboxes > 0 ? nboxes : 1);
+    b->stack = malloc(b->size * sizeof(int));
+    b->top = 0;
+}
+
+void batch_free(BoxBatch *b) {
+    for (int i = 0; i < b->nboxes; i++) free(b->res[i]);
+    free(b->res); free(b->cnt); free(b->cap); free(b->stack);
+}
+
+// Reserves n stack slots and returns their offset; always index b->stack
+// through the offset, since a later reserve may move it
+int batch_reserve(BoxBatch *b, int n) {
+    if (b->top + n > b->size) {
+        while (b->top + n > b->size) b->size *= 2;
+        b->stack = realloc(b->stack, b->size * sizeof(int));
+    }
+    int off = b->top;
+    b->top += n;
+    return off;
+}
+
+// Active list holding every box, the starting point of a batch query
+int batch_all(BoxBatch *b) {
+    int off = batch_reserve(b, b->nboxes);
+    for (int i = 0; i < b->nboxes; i++) b->stack[off + i] = i;
+    return off;
+}
+
+void batch_report(BoxBatch *b, int box, int id) {
+    if (b->cnt[box] == b->cap[box]) {
+        b->cap[box] = b->cap[box] ? 2 * b->cap[box] : 16;
+        b->res[box] = realloc(b->res[box], b->cap[box] * sizeof(int));
+    }
+    b->res[box][b->cnt[box]++] = id;
+}
+
+// Tests live movies against every active box; box-major so each box's
+// result list is appended to in one run while the ids stay in cache
+void batch_report_ids(BoxBatch *b, const int *ids, int n, int act, int nact) {
+    for (int i = 0; i < nact; i++) {
+        int box = b->stack[act + i];
+        double *min = b->min[box], *max = b->max[box];
+        for (int j = 0; j < n; j++) {
+            int id = ids[j];
+            if (!db.deleted[id] && point_in_box(id, min, max)) batch_report(b, box, id);
+        }
+    }
+}
+
+// Random boxes around catalog movies, each side 5-50% of that dimension's span
+void random_boxes(double (*min)[MAX_DIMS], double (*max)[MAX_DIMS], int nboxes, unsigned int seed) {
+    double lo[MAX_DIMS], hi[MAX_DIMS];
+    for (int d = 0; d < k_dims; d++) { lo[d] = INFINITY; hi[d] = -INFINITY; }
+    for (int id = 0; id < db.count; id++) {
+        for (int d = 0; d < k_dims; d++) {
+            if (db.col[d][id] < lo[d]) lo[d] = db.col[d][id];
+            if (db.col[d][id] > hi[d]) hi[d] = db.col[d][id];
+        }
+    }
+    for (int i = 0; i < nboxes; i++) {
+        seed = seed * 1664525u + 1013904223u;
+        int c = db.count > 0 ? (int)(seed % (unsigned int)db.count) : 0;
+        for (int d = 0; d < k_dims; d++) {
+            seed = seed * 1664525u + 1013904223u;
+            double half = (hi[d] - lo[d]) * (0.025 + 0.225 * (seed >> 8) / 16777216.0);
+            double mid = db.count > 0 ? db.col[d][c] : 0.0;
+            min[i][d] = mid - half;
+            max[i][d] = mid + half;
+        }
+    }
+}
+// --- AGGREGATE QUERIES ---
+// Count of the live movies in a subtree plus the sum, min and max of every
+// dimension. The min/max pair is also the subtree's tight bounding box, so a
+// query box that contains it takes the whole subtree in O(1) and a box that
+// misses it skips the subtree: only nodes on the box boundary are opened.
+#define AGG_MIN_SUBTREE 32 // One-movie-per-node trees walk smaller subtrees instead
+
+typedef struct {
+    int count;
+    double sum[MAX_DIMS], min[MAX_DIMS], max[MAX_DIMS];
+} Agg;
+
+void agg_clear(Agg *a) {
+    a->count = 0;
+    for (int d = 0; d < MAX_DIMS; d++) { a->sum[d] = 0.0; a->min[d] = INFINITY; a->max[d] = -INFINITY; }
+}
+
+KERNEL void agg_add_point_k(const int D, Agg *a, const double *c) {
+    a->count++;
+    for (int d = 0; d < D; d++) {
+        a->sum[d] += c[d];
+        if (c[d] < a->min[d]) a->min[d] = c[d];
+        if (c[d] > a->max[d]) a->max[d] = c[d];
+    }
+}
+
+void agg_add_point(Agg *a, const double *c) {
+    DIMS_SWITCH(agg_add_point_k(D, a, c));
+}
+
+// Tombstoned movies are skipped
+void agg_add(Agg *a, int id) {
+    if (db.deleted[id]) return;
+    double c[MAX_DIMS];
+    for (int d = 0; d < k_dims; d++) c[d] = db.col[d][id];
+    agg_add_point(a, c);
+}
+
+KERNEL void agg_merge_k(const int D, Agg *a, const Agg *b) {
+    a->count += b->count;
+    for (int d = 0; d < D; d++) {
+        a->sum[d] += b->sum[d];
+        if (b->min[d] < a->min[d]) a->min[d] = b->min[d];
+        if (b->max[d] > a->max[d]) a->max[d] = b->max[d];
+    }
+}
+
+void agg_merge(Agg *a, const Agg *b) {
+    DIMS_SWITCH(agg_merge_k(D, a, b));
+}
+
+int agg_inside(const Agg *a, double min[], double max[]) {
+    DIMS_SWITCH(return box_inside_k(D, a->min, a->max, min, max));
+}
+
+int agg_disjoint(const Agg *a, double min[], double max[]) {
+    return a->count == 0 || !box_overlaps(a->min, a->max, min, max);
+}
+
+// Whether p lies in the box, the pruning test when looking for a movie to delete
+int agg_contains(const Agg *a, const double *p) {
+    for (int d = 0; d < k_dims; d++) {
+        if (p[d] < a->min[d] || p[d] > a->max[d]) return 0;
+    }
+    return 1;
+}
+
+// Takes a live movie back out of a. Returns 0, leaving a as it was, when the
+// movie may hold one of its extremes (or is tombstoned) and a must be rebuilt.
+int agg_remove(Agg *a, int id) {
+    if (db.deleted[id]) return 0;
+    for (int d = 0; d < k_dims; d++) {
+        double v = db.col[d][id];
+        if (v <= a->min[d] || v >= a->max[d]) return 0;
+    }
+    a->count--;
+    for (int d = 0; d < k_dims; d++) a->sum[d] -= db.col[d][id];
+    return 1;
+}
+
+void agg_point(int id, double *p) {
+    for (int d = 0; d < k_dims; d++) p[d] = db.col[d][id];
+}
+
+const char *dim_label(int d) {
+    return dim_fields[dim_field[d]].label;
+}
+
+// Demo line: the aggregate next to materializing the same box
+void print_agg(const Agg *a, double agg_time, int listed, double list_time) {
+    printf("\n[Aggregate Query] %d movies in %.6fs (listing %d ids: %.6fs)\n", a->count, agg_time, listed, list_time);
+    for (int d = 0; d < k_dims && a->count > 0; d++) {
+        printf("  %-10s sum %.4g, avg %.4g, min %.4g, max %.4g\n",
+               dim_label(d), a->sum[d], a->sum[d] / a->count, a->min[d], a->max[d]);
+    }
+}
+
+// --- BINARY SNAPSHOT ---
+// A snapshot holds the loaded store and any built indexes as named sections
+// behind a fixed header. Sections are 64-byte aligned plain arrays (index
+// nodes refer to each other by position, never by pointer), so an opened
+// snapshot is used in place: the store's columns point into the mapping and
+// indexes are queried from it. The mapping is private, so tombstones and
+// updates made afterwards stay in memory. Files are in host byte order.
+#define SNAP_MAGIC "MVSNAP"
+#define SNAP_VERSION 2
+#define SNAP_MAX_SECTIONS 32
+#define SNAP_ALIGN 64
+
+typedef struct {
+    char tag[16];
+    long long offset, size;
+} SnapSection;
+
+typedef struct {
+    char magic[8];
+    unsigned int version, k_dims, movie_size, nsections;
+    int count;
+    unsigned int fields; // dim_field[d] in bits 4d .. 4d+3
+    SnapSection sec[SNAP_MAX_SECTIONS];
+} SnapHeader;
+
+typedef struct {
+    FILE *f;
+    SnapHeader hdr;
+    long long pos;
+} SnapWriter;
+
+typedef struct {
+    char *base;
+    long size;
+    SnapHeader *hdr;
+} Snapshot;
+
+void snap_write(SnapWriter *w, const char *tag, const void *data, long long size) {
+    static const char zeros[SNAP_ALIGN];
+    if (w->hdr.nsections == SNAP_MAX_SECTIONS) { printf("ERROR: Too many snapshot sections.\n"); return; }
+    long long pad = (SNAP_ALIGN - w->pos % SNAP_ALIGN) % SNAP_ALIGN;
+    fwrite(zeros, 1, pad, w->f);
+    w->pos += pad;
+    SnapSection *sec = &w->hdr.sec[w->hdr.nsections++];
+    snprintf(sec->tag, sizeof(sec->tag), "%s", tag);
+    sec->offset = w->pos;
+    sec->size = size;
+    if (size > 0) fwrite(data, 1, size, w->f);
+    w->pos += size;
+}
+
+// Starts a snapshot of the current store; indexes add their own sections
+int snap_create(SnapWriter *w, const char *path) {
+    w->f = fopen(path, "wb");
+    if (!w->f) { printf("ERROR: Cannot write %s.\n", path); return 0; }
+    memset(&w->hdr, 0, sizeof(w->hdr));
+    memcpy(w->hdr.magic, SNAP_MAGIC, sizeof(SNAP_MAGIC));
+    w->hdr.version = SNAP_VERSION;
+    w->hdr.k_dims = k_dims;
+    for (int d = 0; d < k_dims; d++) w->hdr.fields |= (unsigned int)dim_field[d] << (4 * d);
+    w->hdr.movie_size = sizeof(Movie);
+    w->hdr.count = db.count;
+    fwrite(&w->hdr, sizeof(w->hdr), 1, w->f); // Rewritten by snap_finish
+    w->pos = sizeof(w->hdr);
+
+    char tag[16];
+    for (int d = 0; d < k_dims; d++) {
+        snprintf(tag, sizeof(tag), "col%d", d);
+        snap_write(w, tag, db.col[d], db.count * sizeof(double));
+        if (db.norm[d] == db.col[d]) continue;
+        snprintf(tag, sizeof(tag), "norm%d", d);
+        snap_write(w, tag, db.norm[d], db.count * sizeof(double));
+    }
+    snap_write(w, "deleted", db.deleted, db.count);
+    snap_write(w, "info", db.info, (long long)db.count * sizeof(Movie));
+    return 1;
+}
+
+int snap_finish(SnapWriter *w) {
+    fseek(w->f, 0, SEEK_SET);
+    fwrite(&w->hdr, sizeof(w->hdr), 1, w->f);
+    int ok = !ferror(w->f);
+    fclose(w->f);
+    if (!ok) printf("ERROR: Snapshot write failed.\n");
+    return ok;
+}
+
+void *snap_find(Snapshot *s, const char *tag, long long *size) {
+    for (unsigned int i = 0; i < s->hdr->nsections; i++) {
+        if (strncmp(s->hdr->sec[i].tag, tag, sizeof(s->hdr->sec[i].tag)) != 0) continue;
+        if (size) *size = s->hdr->sec[i].size;
+        return s->base + s->hdr->sec[i].offset;
+    }
+    if (size) *size = 0;
+    return NULL;
+}
+
+// Maps a snapshot and points the global store at it
+int snap_open(Snapshot *s, const char *path) {
+    s->base = map_file(path, &s->size);
+    if (!s->base) { printf("ERROR: File %s not found.\n", path); return 0; }
+    s->hdr = (SnapHeader*)s->base;
+    const char *why = NULL;
+    if (s->size < (long)sizeof(SnapHeader) || memcmp(s->hdr->magic, SNAP_MAGIC, sizeof(SNAP_MAGIC)) != 0) why = "not a snapshot";
+    else if (s->hdr->version != SNAP_VERSION) why = "unsupported version";
+    else if (s->hdr->k_dims < 2 || s->hdr->k_dims > MAX_DIMS || s->hdr->movie_size != sizeof(Movie)) why = "built with a different record layout";
+    else if (s->hdr->nsections > SNAP_MAX_SECTIONS) why = "corrupt header";
+    for (unsigned int i = 0; !why && i < s->hdr->nsections; i++) {
+        SnapSection *sec = &s->hdr->sec[i];
+        if (sec->offset < 0 || sec->size < 0 || sec->offset + sec->size > s->size) why = "truncated";
+    }
+    for (unsigned int d = 0; !why && d < s->hdr->k_dims; d++) {
+        if (((s->hdr->fields >> (4 * d)) & 15) >= (unsigned int)NUM_DIM_FIELDS) why = "unknown dimension field";
+    }
+    // The store's sections must be present (norm* only when written) and
+    // hold count records each
+    long long count = s->hdr->count, size;
+    char tag[16];
+    if (!why && count < 0) why = "corrupt header";
+    for (unsigned int d = 0; !why && d < s->hdr->k_dims; d++) {
+        snprintf(tag, sizeof(tag), "col%u", d);
+        if (!snap_find(s, tag, &size) || size < count * (long long)sizeof(double)) why = "missing or short store section";
+        snprintf(tag, sizeof(tag), "norm%u", d);
+        if (snap_find(s, tag, &size) && size < count * (long long)sizeof(double)) why = "missing or short store section";
+    }
+    if (!why && (!snap_find(s, "deleted", &size) || size < count)) why = "missing or short store section";
+    if (!why && (!snap_find(s, "info", &size) || size < count * (long long)sizeof(Movie))) why = "missing or short store section";
+    if (why) {
+        printf("ERROR: %s: %s.\n", path, why);
+        unmap_file(s->base, s->size);
+        return 0;
+    }
+#ifndef _WIN32
+    madvise(s->base, s->size, MADV_NORMAL); // Queries jump around the file
+#endif
+
+    // The snapshot's dimensions replace the MOVIES_DIMS choice
+    store_free();
+    k_dims = s->hdr->k_dims;
+    for (int d = 0; d < k_dims; d++) dim_field[d] = (s->hdr->fields >> (4 * d)) & 15;
+    for (int d = 0; d < k_dims; d++) {
+        snprintf(tag, sizeof(tag), "col%d", d);
+        db.col[d] = snap_find(s, tag, NULL);
+        snprintf(tag, sizeof(tag), "norm%d", d);
+        db.norm[d] = snap_find(s, tag, NULL);
+        if (!db.norm[d]) db.norm[d] = db.col[d];
+    }
+    db.deleted = snap_find(s, "deleted", NULL);
+    db.info = snap_find(s, "info", NULL);
+    db.count = s->hdr->count;
+    db.capacity = db.count > 0 ? db.count : 1;
+    db.mapped = 1;
+    return 1;
+}
+
+void snap_close(Snapshot *s) {
+    if (db.mapped) memset(&db, 0, sizeof(db));
+    unmap_file(s->base, s->size);
+}
+
+// --- BOX TREE IMAGE ---
+// Pointer-free form shared by the quadtree and the R-tree: nodes in BFS order
+// so the children of a node are contiguous, leaves index into one id array
+typedef struct {
+    double min[MAX_DIMS], max[MAX_DIMS];
+    int first; // First child node, or first entry of the id array for a leaf
+    int count;
+    int is_leaf, pad;
+} BoxImageNode;
+
+// Whether a mapped image can be walked without leaving its sections: every
+// child range lies after its parent (so walks end) and inside the node array,
+// every leaf range inside the id array, and every id names a stored movie
+int box_image_valid(const BoxImageNode *nodes, long long nnodes, const int *ids, long long nids) {
+    for (long long i = 0; i < nnodes; i++) {
+        const BoxImageNode *n = &nodes[i];
+        if (n->count < 0) return 0;
+        if (n->is_leaf && (n->first < 0 || n->first + (long long)n->count > nids)) return 0;
+        if (!n->is_leaf && (n->first <= i || n->first + (long long)n->count > nnodes)) return 0;
+    }
+    for (long long j = 0; j < nids; j++) {
+        if (ids[j] < 0 || ids[j] >= db.count) return 0;
+    }
+    return 1;
+}
+
+void query_box_image(const BoxImageNode *nodes, const int *ids, int i, double min[], double max[], int *res, int *cnt) {
+    const BoxImageNode *n = &nodes[i];
+    if (!box_overlaps(n->min, n->max, min, max)) return;
+    if (n->is_leaf) {
+        for (int j = n->first; j < n->first + n->count; j++) {
+            if (!db.deleted[ids[j]] && point_in_box(ids[j], min, max)) res[(*cnt)++] = ids[j];
+        }
+    } else {
+        for (int j = n->first; j < n->first + n->count; j++) query_box_image(nodes, ids, j, min, max, res, cnt);
+    }
+}
+
+// The box every demo queries: Budget 1000-50000, Popularity 2-50, Runtime 60-180
+// for whichever of them are active, the other dimensions unbounded
+void demo_box(double min[], double max[]) {
+    for(int i=0; i<k_dims; i++) {
+        min[i] = dim_fields[dim_field[i]].demo_lo;
+        max[i] = dim_fields[dim_field[i]].demo_hi;
+    }
+}
+
+// Shared tail of the --snapshot demos: timings plus a kNN over the matches
+void print_snapshot_demo(const char *path, double open_time, double query_time, int *results, int count) {
+    printf("[Snapshot] Opened %s (%d movies) in %.3f ms\n", path, db.count, open_time * 1000.0);
+    printf("Query Found: %d movies in %.4fs\n", count, query_time);
+    if (count > 0) {
+        Neighbor nn[5];
+        int found = run_knn(results[0], results, count, 5, nn);
+        print_neighbors("kNN Snapshot", results[0], nn, found);
     }
-    fclose(file);
-    printf("Loaded %d movies.\n", count);
-    return count;
 }
 #endif
\ No newline at end of file
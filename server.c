@@ -0,0 +1,338 @@
+#include "movies_common.h"
+
+// Resident query server: loads the catalog once, builds every index and the
+// LSH tables, then answers one command per line on stdin or on a Unix domain
+// socket (one thread per connection). Every reply is a status line, zero or
+// more result lines and a closing END line:
+//   RANGE <index> <min0> <max0> ... <min(K-1)> <max(K-1)> [LIMIT n]
+//       -> OK <count> <microseconds>, then "<id> <title>" per match (20 by default)
+//   COUNT <index> <bounds...> -> OK <count> <microseconds> only
+//   AGG <index> <bounds...>   -> "<dimension> <sum> <avg> <min> <max>" per dimension
+//   KNN <id> <k>              -> "<id> <distance> <title>" per neighbor (k-d tree)
+//   SIMILAR <id> [min_jaccard] -> "<id> <jaccard> <title>" per LSH candidate
+//   INFO <id>                 -> "<id> <coordinates...> <title>"
+//   STATS                     -> catalog size and index names
+//   QUIT                      -> ends the session; SHUTDOWN stops the server
+// Indexes: kdtree, kdflat, quad, range, rtree. Bounds accept inf and -inf.
+// Errors reply "ERR <message>" followed by END.
+#define TREE_NO_MAIN
+#include "tree_kdtree.c"
+#include "tree_quad.c"
+#include "tree_range.c"
+#include "tree_rtree.c"
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <signal.h>
+#endif
+
+#define SERVER_MAX_WORDS 64
+#define SERVER_LIST 20 // Result lines shown when no LIMIT is given
+
+KDNode *kd_root;
+FlatKD flat_kd;
+QuadNode *quad_root;
+RangeNode *range_root;
+RNode *rtree_root;
+LshIndex lsh;
+pthread_mutex_t lsh_lock = PTHREAD_MUTEX_INITIALIZER; // lsh_query reuses its mark array
+volatile int server_stop = 0;
+
+void build_all() {
+    int n = db.count;
+    int *ids = malloc((n > 0 ? n : 1) * sizeof(int));
+    double t0 = wall_time();
+    for(int i=0; i<n; i++) ids[i] = i;
+    kd_root = build_kdtree(ids, n, 0);
+    for(int i=0; i<n; i++) ids[i] = i;
+    build_flatkd(&flat_kd, ids, n);
+    for(int i=0; i<n; i++) ids[i] = i;
+    quad_root = build_quad(ids, n);
+    for(int i=0; i<n; i++) ids[i] = i;
+    range_root = build_range(ids, n);
+    for(int i=0; i<n; i++) ids[i] = i;
+    rtree_root = build_rtree(ids, n);
+    lsh_build(&lsh, n);
+    fprintf(stderr, "Built all indexes for %d movies in %.3fs\n", n, wall_time() - t0);
+    free(ids);
+}
+
+// Returns 0 for an unknown index name
+int server_query(const char *name, double min[], double max[], int *res, int *cnt) {
+    if (strcmp(name, "kdtree") == 0) query_kdtree(kd_root, min, max, res, cnt);
+    else if (strcmp(name, "kdflat") == 0) query_flatkd(&flat_kd, min, max, res, cnt);
+    else if (strcmp(name, "quad") == 0) query_quad(quad_root, min, max, res, cnt);
+    else if (strcmp(name, "range") == 0) query_range(range_root, min, max, res, cnt);
+    else if (strcmp(name, "rtree") == 0) query_rtree(rtree_root, min, max, res, cnt);
+    else return 0;
+    return 1;
+}
+
+int split_words(char *line, char **w) {
+    int n = 0;
+    char *p = line;
+    while (n < SERVER_MAX_WORDS) {
+        p += strspn(p, " \t\r\n");
+        if (!*p) break;
+        w[n++] = p;
+        p += strcspn(p, " \t\r\n");
+        if (*p) *p++ = '\0';
+    }
+    return n;
+}
+
+int server_aggregate(const char *name, double min[], double max[], Agg *out) {
+    if (strcmp(name, "kdtree") == 0) agg_kdtree(kd_root, min, max, out);
+    else if (strcmp(name, "kdflat") == 0) agg_flatkd(&flat_kd, min, max, out);
+    else if (strcmp(name, "quad") == 0) agg_quad(quad_root, min, max, out);
+    else if (strcmp(name, "range") == 0) agg_range(range_root, min, max, out);
+    else if (strcmp(name, "rtree") == 0) agg_rtree(rtree_root, min, max, out);
+    else return 0;
+    return 1;
+}
+
+// Parses a whole word as a number or a movie id
+int parse_num(const char *s, double *v) {
+    char *end;
+    *v = strtod(s, &end);
+    return end != s && *end == '\0';
+}
+
+// A whole number in lo..hi
+int parse_int(const char *s, int lo, int hi, int *out) {
+    double v;
+    if (!parse_num(s, &v) || v < lo || v > hi || v != (int)v) return 0;
+    *out = (int)v;
+    return 1;
+}
+
+int parse_id(const char *s, int *id) {
+    return parse_int(s, 0, db.count - 1, id);
+}
+
+// Runs one command; returns 0 to end the session, -1 to stop the server
+int handle_command(char *line, FILE *out, int *res) {
+    char *w[SERVER_MAX_WORDS];
+    int nw = split_words(line, w);
+    if (nw == 0) return 1;
+    int ret = 1;
+
+    if (strcmp(w[0], "RANGE") == 0) {
+        double min[MAX_DIMS], max[MAX_DIMS];
+        int limit = SERVER_LIST, ok = (nw == 2 + 2 * k_dims || nw == 4 + 2 * k_dims);
+        for(int d=0; ok && d<k_dims; d++) {
+            ok = parse_num(w[2 + 2 * d], &min[d]) && parse_num(w[3 + 2 * d], &max[d]);
+        }
+        if (ok && nw == 4 + 2 * k_dims) {
+            double v;
+            ok = strcmp(w[2 + 2 * k_dims], "LIMIT") == 0 && parse_num(w[3 + 2 * k_dims], &v) && v >= 0;
+            limit = ok ? (int)v : 0;
+        }
+        int cnt = 0;
+        double t0 = wall_time();
+        if (!ok) fprintf(out, "ERR usage: RANGE <index> <min0> <max0> ... (%d pairs) [LIMIT n]\n", k_dims);
+        else if (!server_query(w[1], min, max, res, &cnt)) fprintf(out, "ERR unknown index %s\n", w[1]);
+        else {
+            fprintf(out, "OK %d %.1f\n", cnt, (wall_time() - t0) * 1e6);
+            for(int i=0; i<cnt && i<limit; i++) fprintf(out, "%d %s\n", res[i], db.info[res[i]].title);
+        }
+    } else if (strcmp(w[0], "COUNT") == 0 || strcmp(w[0], "AGG") == 0) {
+        double min[MAX_DIMS], max[MAX_DIMS];
+        int ok = nw == 2 + 2 * k_dims;
+        for(int d=0; ok && d<k_dims; d++) {
+            ok = parse_num(w[2 + 2 * d], &min[d]) && parse_num(w[3 + 2 * d], &max[d]);
+        }
+        Agg agg;
+        double t0 = wall_time();
+        if (!ok) fprintf(out, "ERR usage: %s <index> <min0> <max0> ... (%d pairs)\n", w[0], k_dims);
+        else if (!server_aggregate(w[1], min, max, &agg)) fprintf(out, "ERR unknown index %s\n", w[1]);
+        else {
+            fprintf(out, "OK %d %.1f\n", agg.count, (wall_time() - t0) * 1e6);
+            for(int d=0; strcmp(w[0], "AGG") == 0 && agg.count > 0 && d<k_dims; d++) {
+                fprintf(out, "%s %.6g %.6g %.6g %.6g\n", dim_label(d), agg.sum[d], agg.sum[d] / agg.count, agg.min[d], agg.max[d]);
+            }
+        }
+    } else if (strcmp(w[0], "KNN") == 0) {
+        int target, k;
+        if (nw != 3 || !parse_id(w[1], &target) || !parse_int(w[2], 1, db.count - 1, &k)) {
+            fprintf(out, "ERR usage: KNN <id> <k>\n");
+        } else {
+            Neighbor *nn = malloc(k * sizeof(Neighbor));
+            double t0 = wall_time();
+            int found = knn_kdtree(kd_root, target, k, nn);
+            fprintf(out, "OK %d %.1f\n", found, (wall_time() - t0) * 1e6);
+            for(int i=0; i<found; i++) fprintf(out, "%d %.4f %s\n", nn[i].id, nn[i].dist, db.info[nn[i].id].title);
+            free(nn);
+        }
+    } else if (strcmp(w[0], "SIMILAR") == 0) {
+        int target;
+        double min_sim = 0.3;
+        if (nw < 2 || nw > 3 || !parse_id(w[1], &target) || (nw == 3 && !parse_num(w[2], &min_sim))) {
+            fprintf(out, "ERR usage: SIMILAR <id> [min_jaccard]\n");
+        } else {
+            double t0 = wall_time();
+            pthread_mutex_lock(&lsh_lock);
+            int nc = lsh_query(&lsh, target, res);
+            pthread_mutex_unlock(&lsh_lock);
+            int m = 0;
+            for(int i=0; i<nc; i++) {
+                if (jaccard_similarity(target, res[i]) > min_sim) res[m++] = res[i];
+            }
+            fprintf(out, "OK %d %.1f\n", m, (wall_time() - t0) * 1e6);
+            for(int i=0; i<m && i<SERVER_LIST; i++) {
+                fprintf(out, "%d %.2f %s\n", res[i], jaccard_similarity(target, res[i]), db.info[res[i]].title);
+            }
+        }
+    } else if (strcmp(w[0], "INFO") == 0) {
+        int id;
+        if (nw != 2 || !parse_id(w[1], &id)) fprintf(out, "ERR usage: INFO <id>\n");
+        else {
+            fprintf(out, "OK 1 0.0\n%d", id);
+            for(int d=0; d<k_dims; d++) fprintf(out, " %.2f", db.col[d][id]);
+            fprintf(out, " %s%s\n", db.info[id].title, db.deleted[id] ? " (deleted)" : "");
+        }
+    } else if (strcmp(w[0], "STATS") == 0) {
+        fprintf(out, "OK %d 0.0\nmovies %d dims %d indexes kdtree kdflat quad range rtree\n", db.count, db.count, k_dims);
+    } else if (strcmp(w[0], "QUIT") == 0) {
+        fprintf(out, "OK 0 0.0\n");
+        ret = 0;
+    } else if (strcmp(w[0], "SHUTDOWN") == 0) {
+        fprintf(out, "OK 0 0.0\n");
+        ret = -1;
+    } else {
+        fprintf(out, "ERR unknown command %s\n", w[0]);
+    }
+    fprintf(out, "END\n");
+    fflush(out);
+    return ret;
+}
+
+// Serves one session; returns -1 when the server should stop
+int serve_stream(FILE *in, FILE *out) {
+    int *res = malloc((db.count > 0 ? db.count : 1) * sizeof(int));
+    char line[MAX_LINE];
+    int ret = 0;
+    while (!server_stop && fgets(line, sizeof(line), in)) {
+        ret = handle_command(line, out, res);
+        if (ret <= 0 || ferror(out)) break; // A failed write means the client is gone
+    }
+    free(res);
+    return ret < 0 ? -1 : 0;
+}
+
+#ifndef _WIN32
+#define SERVER_MAX_CLIENTS 64
+
+int server_fd = -1;
+// Open sessions, so that a shutdown can wake them and wait for them before
+// the indexes are freed
+int client_fds[SERVER_MAX_CLIENTS], nclients = 0;
+pthread_mutex_t client_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t client_gone = PTHREAD_COND_INITIALIZER;
+
+void *serve_client(void *arg) {
+    int fd = (int)(long)arg;
+    FILE *in = fdopen(fd, "r"), *out = fdopen(dup(fd), "w");
+    if (in && out && serve_stream(in, out) < 0) {
+        server_stop = 1;
+        shutdown(server_fd, SHUT_RDWR); // Wakes the accept loop
+    }
+    pthread_mutex_lock(&client_lock);
+    for(int i=0; i<nclients; i++) {
+        if (client_fds[i] == fd) { client_fds[i] = client_fds[--nclients]; break; }
+    }
+    pthread_cond_signal(&client_gone);
+    pthread_mutex_unlock(&client_lock); // Before the close, so the fd number is not reused while listed
+    if (in) fclose(in); else close(fd);
+    if (out) fclose(out);
+    return NULL;
+}
+
+int serve_socket(const char *path) {
+    struct sockaddr_un addr;
+    if (strlen(path) >= sizeof(addr.sun_path)) { fprintf(stderr, "ERROR: Socket path too long.\n"); return 1; }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    server_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(path);
+    if (server_fd < 0 || bind(server_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(server_fd, 16) < 0) {
+        fprintf(stderr, "ERROR: Cannot listen on %s.\n", path);
+        return 1;
+    }
+    fprintf(stderr, "Listening on %s\n", path);
+    signal(SIGPIPE, SIG_IGN); // Writes to a closed client fail with EPIPE instead
+    while (!server_stop) {
+        int fd = accept(server_fd, NULL, NULL);
+        if (fd < 0) break;
+        pthread_t t;
+        pthread_mutex_lock(&client_lock);
+        int ok = nclients < SERVER_MAX_CLIENTS && pthread_create(&t, NULL, serve_client, (void*)(long)fd) == 0;
+        if (ok) {
+            client_fds[nclients++] = fd;
+            pthread_detach(t);
+        }
+        pthread_mutex_unlock(&client_lock);
+        if (!ok) close(fd);
+    }
+    close(server_fd);
+    unlink(path);
+    // Other sessions may be mid-query: end their reads and wait for them
+    pthread_mutex_lock(&client_lock);
+    for(int i=0; i<nclients; i++) shutdown(client_fds[i], SHUT_RDWR);
+    while (nclients > 0) pthread_cond_wait(&client_gone, &client_lock);
+    pthread_mutex_unlock(&client_lock);
+    return 0;
+}
+#endif
+
+int main(int argc, char **argv) {
+    const char *csv = "movies.csv", *snap_path = NULL, *sock = NULL;
+    for(int i=1; i<argc; i++) {
+        if (i + 1 < argc && strcmp(argv[i], "--csv") == 0) csv = argv[++i];
+        else if (i + 1 < argc && strcmp(argv[i], "--snapshot") == 0) snap_path = argv[++i];
+        else if (i + 1 < argc && strcmp(argv[i], "--socket") == 0) sock = argv[++i];
+        else {
+            fprintf(stderr, "Usage: server.exe [--csv FILE | --snapshot FILE] [--socket PATH]\n");
+            return 1;
+        }
+    }
+
+    // Progress goes to stderr so stdout only carries replies
+    Snapshot snap;
+    if (snap_path) {
+        if (!snap_open(&snap, snap_path)) return 1;
+    } else {
+#ifndef _WIN32
+        int saved = dup(1);
+        dup2(2, 1);
+        load_csv(csv);
+        fflush(stdout);
+        dup2(saved, 1);
+        close(saved);
+#else
+        load_csv(csv);
+#endif
+    }
+    build_all();
+
+    int rc = 0;
+    if (sock) {
+#ifdef _WIN32
+        fprintf(stderr, "ERROR: Unix sockets are not available on this platform, use stdin.\n");
+        rc = 1;
+#else
+        rc = serve_socket(sock);
+#endif
+    } else serve_stream(stdin, stdout);
+
+    reset_kd_arena();
+    free_flatkd(&flat_kd);
+    reset_quad_arena();
+    reset_range_arena();
+    reset_rtree_arena();
+    lsh_free(&lsh);
+    if (snap_path) snap_close(&snap);
+    else store_free();
+    return rc;
+}
@@ -0,0 +1,99 @@
+#include "movies_common.h"
+
+// Regression checks for the quadtree's data-derived root box: a catalog with
+// one movie or a constant column must still place, find and delete movies
+// inserted after the root has grown. Exits nonzero on the first failure.
+#define TREE_NO_MAIN
+#include "tree_quad.c"
+
+int failures = 0;
+
+void check(int ok, const char *what) {
+    printf("%s: %s\n", ok ? "ok  " : "FAIL", what);
+    if (!ok) failures++;
+}
+
+int add_movie(double x, double y) {
+    double v[MAX_DIMS] = { x, y };
+    int id = store_add(v);
+    snprintf(db.info[id].title, sizeof(db.info[id].title), "movie %d", id);
+    return id;
+}
+
+// Every live movie is reported by query_quad, query_quad_batch and agg_quad
+// in a tight box around it, and is then deleted
+void check_all_found(QuadNode **root, const char *label) {
+    char what[128];
+    int *res = malloc(db.count * sizeof(int));
+    int lost = 0, batch_lost = 0, agg_lost = 0, undeleted = 0;
+    for(int id=0; id<db.count; id++) {
+        double min[MAX_DIMS], max[MAX_DIMS];
+        for(int d=0; d<k_dims; d++) { min[d] = db.col[d][id] - 0.05; max[d] = db.col[d][id] + 0.05; }
+        int cnt = 0, hit = 0;
+        query_quad(*root, min, max, res, &cnt);
+        for(int i=0; i<cnt; i++) hit |= (res[i] == id);
+        lost += !hit;
+
+        double bmin[1][MAX_DIMS], bmax[1][MAX_DIMS];
+        memcpy(bmin[0], min, sizeof(min));
+        memcpy(bmax[0], max, sizeof(max));
+        BoxBatch batch;
+        batch_init(&batch, bmin, bmax, 1);
+        query_quad_batch(*root, &batch);
+        batch_lost += (batch.cnt[0] != cnt);
+        batch_free(&batch);
+
+        Agg agg;
+        agg_quad(*root, min, max, &agg);
+        agg_lost += (agg.count != cnt);
+    }
+    for(int id=db.count-1; id>=0; id--) {
+        undeleted += !delete_quad(root, id);
+        db.deleted[id] = 1;
+    }
+    free(res);
+    snprintf(what, sizeof(what), "%s: query_quad finds every movie", label);
+    check(lost == 0, what);
+    snprintf(what, sizeof(what), "%s: query_quad_batch matches query_quad", label);
+    check(batch_lost == 0, what);
+    snprintf(what, sizeof(what), "%s: agg_quad matches query_quad", label);
+    check(agg_lost == 0, what);
+    snprintf(what, sizeof(what), "%s: delete_quad removes every movie", label);
+    check(undeleted == 0, what);
+}
+
+void test_single_movie() {
+    store_init(4);
+    int ids[1];
+    ids[0] = add_movie(10.0, 10.0);
+    QuadNode *root = build_quad(ids, 1);
+    root = insert_quad_root(root, add_movie(5.0, 10.0));   // Grows the root
+    root = insert_quad_root(root, add_movie(9.7, 10.2));   // Lands beside the old root
+    check_all_found(&root, "single movie");
+    reset_quad_arena();
+    store_free();
+}
+
+void test_constant_column() {
+    int n = 3 * LEAF_CAP;
+    store_init(n + 4);
+    int *ids = malloc(n * sizeof(int));
+    for(int i=0; i<n; i++) ids[i] = add_movie(i * 1.5, 10.0);
+    QuadNode *root = build_quad(ids, n);
+    root = insert_quad_root(root, add_movie(20.0, 3.0));
+    root = insert_quad_root(root, add_movie(30.0, 10.2));
+    root = insert_quad_root(root, add_movie(31.0, 9.7));
+    update_quad(&root, 7, 10.4);
+    check_all_found(&root, "constant column");
+    free(ids);
+    reset_quad_arena();
+    store_free();
+}
+
+int main() {
+    dims_configure("2");
+    test_single_movie();
+    test_constant_column();
+    printf("%s\n", failures ? "FAILED" : "All quadtree checks passed.");
+    return failures ? 1 : 0;
+}
@@ -1,12 +1,16 @@
 #include "movies_common.h"
 
 typedef struct KDNode {
-    Movie *movie;
+    int id;
     struct KDNode *left, *right;
     int axis;
+    double split; // Movie's value on axis when it was placed, kept after it is removed
+    int size, dead; // Nodes in the subtree and how many of them are removed
+    int removed;
+    Agg *agg; // Subtrees of at least AGG_MIN_SUBTREE nodes, NULL below
 } KDNode;
 
-int current_axis_sort = 0;
+Arena kd_arena; // Every KDNode and Agg lives here
 
 // Function to calculate memory usage
 long count_nodes(KDNode *node) {
@@ -14,122 +18,718 @@ long count_nodes(KDNode *node) {
     return 1 + count_nodes(node->left) + count_nodes(node->right);
 }
 
-int cmp_dynamic(const void *a, const void *b) {
-    Movie *m1 = *(Movie**)a;
-    Movie *m2 = *(Movie**)b;
-    if (m1->values[current_axis_sort] > m2->values[current_axis_sort]) return 1;
-    if (m1->values[current_axis_sort] < m2->values[current_axis_sort]) return -1;
-    return 0;
+long get_kd_memory(KDNode *node) {
+    if (!node) return 0;
+    return sizeof(KDNode) + (node->agg ? sizeof(Agg) : 0) + get_kd_memory(node->left) + get_kd_memory(node->right);
 }
 
-KDNode* build_kdtree(Movie **mptr, int n, int depth) {
-    if (n <= 0) return NULL;
-    int axis = depth % K_DIMS;
-    current_axis_sort = axis;
-    qsort(mptr, n, sizeof(Movie*), cmp_dynamic);
+// --- Subtree aggregates ---
+void kd_agg_walk(KDNode *node, Agg *a) {
+    if (!node) return;
+    if (!node->removed) agg_add(a, node->id);
+    kd_agg_walk(node->left, a);
+    kd_agg_walk(node->right, a);
+}
+
+// Rebuilds node->agg from its movie and the children's aggregates
+void kd_agg_recompute(KDNode *node) {
+    agg_clear(node->agg);
+    if (!node->removed) agg_add(node->agg, node->id);
+    KDNode *child[2] = { node->left, node->right };
+    for(int i=0; i<2; i++) {
+        if (child[i] && child[i]->agg) agg_merge(node->agg, child[i]->agg);
+        else kd_agg_walk(child[i], node->agg);
+    }
+}
+
+// Quickselect with a 3-way partition (duplicates such as Budget = 0 are common):
+// afterwards ids[k] holds the k-th smallest value on `axis`, everything before
+// it is <= and everything after it is >=. Expected O(n), no global sort state.
+void select_kth(int *ids, int n, int k, int axis) {
+    double *v = db.col[axis];
+    int lo = 0, hi = n - 1;
+    while (lo < hi) {
+        double a = v[ids[lo]], b = v[ids[lo + (hi - lo) / 2]], c = v[ids[hi]];
+        double pivot = (a < b) ? ((b < c) ? b : (a < c ? c : a)) : ((a < c) ? a : (b < c ? c : b));
+        int lt = lo, i = lo, gt = hi;
+        while (i <= gt) {
+            double x = v[ids[i]];
+            int t;
+            if (x < pivot) { t = ids[lt]; ids[lt++] = ids[i]; ids[i++] = t; }
+            else if (x > pivot) { t = ids[gt]; ids[gt--] = ids[i]; ids[i] = t; }
+            else i++;
+        }
+        if (k < lt) hi = lt - 1;
+        else if (k > gt) lo = gt + 1;
+        else return;
+    }
+}
 
+// O(n log n): one linear median selection per level instead of a full qsort
+KDNode* build_kdtree(int *ids, int n, int depth) {
+    if (n <= 0) return NULL;
+    int axis = depth % k_dims;
     int mid = n / 2;
-    KDNode *node = malloc(sizeof(KDNode));
-    node->movie = mptr[mid];
+    select_kth(ids, n, mid, axis);
+
+    KDNode *node = arena_alloc(&kd_arena, sizeof(KDNode));
+    node->id = ids[mid];
     node->axis = axis;
-    node->left = build_kdtree(mptr, mid, depth + 1);
-    node->right = build_kdtree(mptr + mid + 1, n - mid - 1, depth + 1);
+    node->split = db.col[axis][ids[mid]];
+    node->size = n;
+    node->dead = node->removed = 0;
+    node->left = build_kdtree(ids, mid, depth + 1);
+    node->right = build_kdtree(ids + mid + 1, n - mid - 1, depth + 1);
+    node->agg = NULL;
+    if (n >= AGG_MIN_SUBTREE) {
+        node->agg = arena_alloc(&kd_arena, sizeof(Agg));
+        kd_agg_recompute(node);
+    }
     return node;
 }
 
-KDNode* insert_kdtree(KDNode *node, Movie *m, int depth) {
+// O(1) in the node count: frees every node of the arena, so the tree in
+// use is gone and the next build starts fresh
+void reset_kd_arena(void) {
+    arena_free(&kd_arena);
+}
+
+// --- Partial rebuilds ---
+// Every node counts the nodes below it and how many of those are removed.
+// A subtree is rebuilt from its live movies once removed nodes pass
+// TOMBSTONE_RATIO of it (deletes) or one child holds more than KD_ALPHA of
+// it (inserts, scapegoat style). Only the highest such node on the path is
+// rebuilt, so an update costs O(log n) amortized and dead nodes do not pile up.
+#define KD_ALPHA 0.75
+
+int kd_size(KDNode *node) { return node ? node->size : 0; }
+int kd_dead(KDNode *node) { return node ? node->dead : 0; }
+
+// Recomputes the counts (and aggregate) of node from its children; a subtree
+// grown by inserts gets its aggregate once it reaches AGG_MIN_SUBTREE, as in
+// build_kdtree
+void kd_pull(KDNode *node) {
+    node->size = 1 + kd_size(node->left) + kd_size(node->right);
+    node->dead = node->removed + kd_dead(node->left) + kd_dead(node->right);
+    if (!node->agg && node->size >= AGG_MIN_SUBTREE) node->agg = arena_alloc(&kd_arena, sizeof(Agg));
+    if (node->agg) kd_agg_recompute(node);
+}
+
+int kd_needs_rebuild(KDNode *node) {
+    int heavy = kd_size(node->left) > kd_size(node->right) ? kd_size(node->left) : kd_size(node->right);
+    return node->dead > TOMBSTONE_RATIO * node->size || heavy > KD_ALPHA * node->size;
+}
+
+// Live movies of the subtree into ids[]; its nodes go back to the arena
+void kd_collect(KDNode *node, int *ids, int *n) {
+    if (!node) return;
+    kd_collect(node->left, ids, n);
+    kd_collect(node->right, ids, n);
+    if (!node->removed && !db.deleted[node->id]) ids[(*n)++] = node->id;
+    if (node->agg) arena_release(&kd_arena, node->agg, sizeof(Agg));
+    arena_release(&kd_arena, node, sizeof(KDNode));
+}
+
+KDNode* kd_rebuild(KDNode *node) {
+    int *ids = malloc(node->size * sizeof(int)), n = 0;
+    int axis = node->axis;
+    kd_collect(node, ids, &n);
+    KDNode *fresh = build_kdtree(ids, n, axis);
+    free(ids);
+    return fresh;
+}
+
+// After a change below node: rebuilds the child if it asked for it and node
+// does not need a rebuild itself. Returns whether node asks its parent.
+int kd_settle(KDNode *node, KDNode **child, int child_wants) {
+    kd_pull(node);
+    if (kd_needs_rebuild(node)) return 1;
+    if (child_wants) {
+        *child = kd_rebuild(*child);
+        kd_pull(node);
+    }
+    return 0;
+}
+
+KDNode* kd_insert_rec(KDNode *node, int id, int depth, int *wants) {
     if (!node) {
-        KDNode *n = malloc(sizeof(KDNode));
-        n->movie = m;
-        n->axis = depth % K_DIMS;
+        KDNode *n = arena_alloc(&kd_arena, sizeof(KDNode));
+        n->id = id;
+        n->axis = depth % k_dims;
+        n->split = db.col[n->axis][id];
+        n->size = 1;
+        n->dead = n->removed = 0;
         n->left = n->right = NULL;
+        n->agg = NULL;
+        *wants = 0;
         return n;
     }
-    int axis = node->axis;
-    if (m->values[axis] < node->movie->values[axis]) 
-        node->left = insert_kdtree(node->left, m, depth + 1);
-    else 
-        node->right = insert_kdtree(node->right, m, depth + 1);
+    int child_wants;
+    KDNode **child = (db.col[node->axis][id] < node->split) ? &node->left : &node->right;
+    *child = kd_insert_rec(*child, id, depth + 1, &child_wants);
+    *wants = kd_settle(node, child, child_wants);
     return node;
 }
 
-void free_kdtree(KDNode *node) {
+KDNode* insert_kdtree(KDNode *node, int id, int depth) {
+    int wants;
+    node = kd_insert_rec(node, id, depth, &wants);
+    return wants ? kd_rebuild(node) : node;
+}
+
+int kd_delete_rec(KDNode *node, int id, const double *p, int *wants) {
+    *wants = 0;
+    if (!node || node->dead == node->size) return 0;
+    if (node->agg && !agg_contains(node->agg, p)) return 0;
+    int found = 0, child_wants = 0;
+    KDNode **child = NULL;
+    if (node->id == id && !node->removed) found = node->removed = 1;
+    if (!found && p[node->axis] <= node->split) found = kd_delete_rec(*(child = &node->left), id, p, &child_wants);
+    if (!found && p[node->axis] >= node->split) found = kd_delete_rec(*(child = &node->right), id, p, &child_wants);
+    if (found) *wants = kd_settle(node, child, child_wants);
+    return found;
+}
+
+// Removes a movie from the tree; call it while the movie still has the
+// coordinates it was inserted with. Returns 0 when it is not in the tree.
+int delete_kdtree(KDNode **root, int id) {
+    double p[MAX_DIMS];
+    agg_point(id, p);
+    int wants;
+    int found = kd_delete_rec(*root, id, p, &wants);
+    if (wants) *root = kd_rebuild(*root);
+    return found;
+}
+
+void update_kdtree(KDNode **root, int target, double new_pop) {
+    printf(" [Update] Moved '%s' (Pop: %.2f -> %.2f)\n", db.info[target].title, db.col[1][target], new_pop);
+    delete_kdtree(root, target);
+    store_set(target, 1, new_pop); 
+    *root = insert_kdtree(*root, target, 0);
+}
+
+void query_kdtree(KDNode *node, double min[], double max[], int *res, int *cnt) {
+    if (!node) return;
+    int id = node->id;
+    if (!node->removed && !db.deleted[id] && point_in_box(id, min, max)) res[(*cnt)++] = id;
+    double val = node->split;
+    if (val >= min[node->axis]) query_kdtree(node->left, min, max, res, cnt);
+    if (val <= max[node->axis]) query_kdtree(node->right, min, max, res, cnt);
+}
+
+// Count/sum/min/max over the box without listing the movies
+void agg_kdtree_rec(KDNode *node, double min[], double max[], Agg *out) {
     if (!node) return;
-    free_kdtree(node->left);
-    free_kdtree(node->right);
-    free(node);
+    if (node->agg) {
+        if (agg_disjoint(node->agg, min, max)) return;
+        if (agg_inside(node->agg, min, max)) { agg_merge(out, node->agg); return; }
+    }
+    int id = node->id;
+    if (!node->removed && point_in_box(id, min, max)) agg_add(out, id);
+    double val = node->split;
+    if (val >= min[node->axis]) agg_kdtree_rec(node->left, min, max, out);
+    if (val <= max[node->axis]) agg_kdtree_rec(node->right, min, max, out);
+}
+
+void agg_kdtree(KDNode *root, double min[], double max[], Agg *out) {
+    agg_clear(out);
+    agg_kdtree_rec(root, min, max, out);
+}
+
+// --- Parallel query: tasks are the subtrees below the first few levels ---
+void kd_query_task(QueryTask *t, double min[], double max[], int *res, int *cnt) {
+    query_kdtree(t->node, min, max, res, cnt);
+}
+
+int kd_query_expand(QueryTask *t, double min[], double max[], QueryTaskList *out, int *res, int *cnt) {
+    KDNode *node = t->node;
+    int id = node->id;
+    if (!node->removed && !db.deleted[id] && point_in_box(id, min, max)) res[(*cnt)++] = id;
+    double val = node->split;
+    if (node->left && val >= min[node->axis]) task_push(out, node->left, 0);
+    if (node->right && val <= max[node->axis]) task_push(out, node->right, 0);
+    return 1;
+}
+
+// --- Batched query: one traversal for a set of boxes ---
+void batch_kdtree(KDNode *node, BoxBatch *b, int act, int nact) {
+    int id = node->id, axis = node->axis;
+    if (!node->removed) batch_report_ids(b, &id, 1, act, nact);
+    double val = node->split;
+    for(int side=0; side<2; side++) {
+        KDNode *child = side ? node->right : node->left;
+        if (!child) continue;
+        int off = batch_reserve(b, nact), m = 0;
+        for(int i=0; i<nact; i++) {
+            int box = b->stack[act + i];
+            if (side ? val <= b->max[box][axis] : val >= b->min[box][axis]) b->stack[off + m++] = box;
+        }
+        if (m > 0) batch_kdtree(child, b, off, m);
+        b->top = off;
+    }
 }
 
-void update_kdtree(KDNode **root, Movie *target, double new_pop) {
-    target->is_deleted = 1; 
-    Movie *new_m = malloc(sizeof(Movie));
-    *new_m = *target; 
-    new_m->values[1] = new_pop; 
-    new_m->is_deleted = 0;
-    *root = insert_kdtree(*root, new_m, 0);
-    printf(" [Update] Moved '%s' (Pop: %.2f -> %.2f)\n", target->title, target->values[1], new_pop);
+void query_kdtree_batch(KDNode *root, BoxBatch *b) {
+    if (!root) return;
+    int act = batch_all(b);
+    batch_kdtree(root, b, act, b->nboxes);
+    b->top = act;
 }
 
-void query_kdtree(KDNode *node, double min[], double max[], Movie **res, int *cnt) {
+void query_kdtree_par(KDNode *root, double min[], double max[], int *res, int *cnt) {
+    if (!root) return;
+    QueryTask t = { root, 0 };
+    query_parallel(t, kd_query_expand, kd_query_task, min, max, res, cnt);
+}
+
+// Branch-and-bound kNN: visit the side of the split containing the target first,
+// then the far side only if the splitting hyperplane is closer than the k-th best.
+void knn_search(KDNode *node, int target, KnnHeap *best) {
     if (!node) return;
-    Movie *m = node->movie;
-    if (!m->is_deleted) {
-        int match = 1;
-        for(int i=0; i<K_DIMS; i++) {
-            if (m->values[i] < min[i] || m->values[i] > max[i]) {
-                match = 0; break;
+    int id = node->id;
+    if (!node->removed && !db.deleted[id] && id != target) {
+        double d = euclidean_dist(target, id);
+        if (d < knn_heap_bound(best)) knn_heap_push(best, id, d);
+    }
+    int axis = node->axis;
+    double diff = (db.col[axis][target] - node->split) / dim_scale(axis);
+    KDNode *near = (diff < 0) ? node->left : node->right;
+    KDNode *far = (diff < 0) ? node->right : node->left;
+    knn_search(near, target, best);
+    if (fabs(diff) <= knn_heap_bound(best)) knn_search(far, target, best);
+}
+
+// Fills out[] (size k) with the k nearest live movies, closest first
+int knn_kdtree(KDNode *root, int target, int k, Neighbor *out) {
+    KnnHeap best;
+    knn_heap_init(&best, out, k);
+    if (k > 0) knn_search(root, target, &best);
+    return knn_heap_finish(&best);
+}
+
+// --- Flat k-d tree (pointerless, leaf buckets) ---
+// Internal nodes are stored in BFS (Eytzinger) order: node i has children
+// 2i+1 and 2i+2 and only keeps its split value, the axis being depth % k_dims.
+// Leaves are buckets of at most KD_BUCKET movies whose coordinates are stored
+// contiguously, so a query reads a few cache lines per bucket instead of
+// chasing a pointer per movie. The layout is static: a delete empties the
+// movie's slot (id -1) and the whole tree is compacted once TOMBSTONE_RATIO
+// of the slots are empty; inserts and updates mean a rebuild.
+#define KD_BUCKET 16
+
+typedef struct {
+    double *split;    // nleaves - 1 internal nodes
+    int *leaf_start;  // leaf j holds ids[leaf_start[j] .. leaf_start[j+1])
+    int *ids;         // movie ids in leaf order, -1 for a deleted slot
+    double *coords;   // coords[i * k_dims + d] belongs to ids[i]
+    Agg *agg;         // 2 * nleaves - 1 subtree aggregates, leaves last (NULL: walk)
+    int levels, nleaves, n;
+    int dead;         // Deleted slots
+} FlatKD;
+
+void build_flat_rec(FlatKD *t, int node, int depth, int lo, int hi) {
+    if (depth == t->levels) {
+        t->leaf_start[node - (t->nleaves - 1)] = lo;
+        return;
+    }
+    int axis = depth % k_dims;
+    int mid = lo + (hi - lo) / 2;
+    if (hi > lo) {
+        select_kth(t->ids + lo, hi - lo, mid - lo, axis);
+        t->split[node] = db.col[axis][t->ids[mid]];
+    } else t->split[node] = 0.0;
+    build_flat_rec(t, 2 * node + 1, depth + 1, lo, mid);
+    build_flat_rec(t, 2 * node + 2, depth + 1, mid, hi);
+}
+
+// Leaf aggregates from their buckets, then every internal node bottom-up
+void flat_agg_leaf(FlatKD *t, int leaf) {
+    Agg *a = &t->agg[t->nleaves - 1 + leaf];
+    agg_clear(a);
+    for(int i=t->leaf_start[leaf]; i<t->leaf_start[leaf + 1]; i++) {
+        if (t->ids[i] >= 0) agg_add(a, t->ids[i]);
+    }
+}
+
+void flat_agg_node(FlatKD *t, int node) {
+    t->agg[node] = t->agg[2 * node + 1];
+    agg_merge(&t->agg[node], &t->agg[2 * node + 2]);
+}
+
+void build_flatkd(FlatKD *t, int *ids, int n) {
+    t->n = n;
+    t->dead = 0;
+    t->levels = 0;
+    while (((long)KD_BUCKET << t->levels) < n) t->levels++;
+    t->nleaves = 1 << t->levels;
+    t->split = malloc(t->nleaves * sizeof(double)); // nleaves - 1 used
+    t->leaf_start = malloc((t->nleaves + 1) * sizeof(int));
+    t->ids = malloc((n > 0 ? n : 1) * sizeof(int));
+    t->coords = malloc((n > 0 ? n : 1) * k_dims * sizeof(double));
+    memcpy(t->ids, ids, n * sizeof(int));
+    build_flat_rec(t, 0, 0, 0, n);
+    t->leaf_start[t->nleaves] = n;
+    for(int i=0; i<n; i++) {
+        for(int d=0; d<k_dims; d++) t->coords[i * k_dims + d] = db.col[d][t->ids[i]];
+    }
+    t->agg = malloc((2 * t->nleaves - 1) * sizeof(Agg));
+    for(int j=0; j<t->nleaves; j++) flat_agg_leaf(t, j);
+    for(int i=t->nleaves-2; i>=0; i--) flat_agg_node(t, i);
+}
+
+void free_flatkd(FlatKD *t) {
+    free(t->split); free(t->leaf_start); free(t->ids); free(t->coords); free(t->agg);
+}
+
+long flatkd_memory(FlatKD *t) {
+    return (t->nleaves - 1) * sizeof(double) + (t->nleaves + 1) * sizeof(int)
+         + t->n * (sizeof(int) + k_dims * sizeof(double)) + (2 * t->nleaves - 1) * sizeof(Agg);
+}
+
+// One bucket, with the coordinate stride known at compile time
+KERNEL void flat_scan_leaf_k(const int D, FlatKD *t, int leaf, double min[], double max[], int *res, int *cnt) {
+    for(int i=t->leaf_start[leaf]; i<t->leaf_start[leaf + 1]; i++) {
+        if (coords_in_box_k(D, &t->coords[i * D], min, max) && t->ids[i] >= 0 && !db.deleted[t->ids[i]]) res[(*cnt)++] = t->ids[i];
+    }
+}
+
+void query_flat_rec(FlatKD *t, int node, int depth, double min[], double max[], int *res, int *cnt) {
+    if (depth == t->levels) {
+        int leaf = node - (t->nleaves - 1);
+        DIMS_SWITCH(flat_scan_leaf_k(D, t, leaf, min, max, res, cnt));
+        return;
+    }
+    int axis = depth % k_dims;
+    if (t->split[node] >= min[axis]) query_flat_rec(t, 2 * node + 1, depth + 1, min, max, res, cnt);
+    if (t->split[node] <= max[axis]) query_flat_rec(t, 2 * node + 2, depth + 1, min, max, res, cnt);
+}
+
+void query_flatkd(FlatKD *t, double min[], double max[], int *res, int *cnt) {
+    query_flat_rec(t, 0, 0, min, max, res, cnt);
+}
+
+void agg_flat_rec(FlatKD *t, int node, int depth, double min[], double max[], Agg *out) {
+    if (agg_disjoint(&t->agg[node], min, max)) return;
+    if (agg_inside(&t->agg[node], min, max)) { agg_merge(out, &t->agg[node]); return; }
+    if (depth == t->levels) {
+        int leaf = node - (t->nleaves - 1);
+        for(int i=t->leaf_start[leaf]; i<t->leaf_start[leaf + 1]; i++) {
+            double *c = &t->coords[i * k_dims];
+            if (coords_in_box(c, min, max) && t->ids[i] >= 0 && !db.deleted[t->ids[i]]) agg_add_point(out, c);
+        }
+        return;
+    }
+    int axis = depth % k_dims;
+    if (t->split[node] >= min[axis]) agg_flat_rec(t, 2 * node + 1, depth + 1, min, max, out);
+    if (t->split[node] <= max[axis]) agg_flat_rec(t, 2 * node + 2, depth + 1, min, max, out);
+}
+
+void agg_flatkd(FlatKD *t, double min[], double max[], Agg *out) {
+    agg_clear(out);
+    agg_flat_rec(t, 0, 0, min, max, out);
+}
+
+// Empties the movie's slot, then its bucket and the ancestors get new aggregates
+int flat_delete_rec(FlatKD *t, int node, int depth, int id, const double *p) {
+    if (depth == t->levels) {
+        int leaf = node - (t->nleaves - 1);
+        for(int i=t->leaf_start[leaf]; i<t->leaf_start[leaf + 1]; i++) {
+            if (t->ids[i] == id) {
+                t->ids[i] = -1;
+                flat_agg_leaf(t, leaf);
+                return 1;
             }
         }
-        if (match) res[(*cnt)++] = m;
+        return 0;
     }
-    double val = m->values[node->axis];
-    if (val >= min[node->axis]) query_kdtree(node->left, min, max, res, cnt);
-    if (val <= max[node->axis]) query_kdtree(node->right, min, max, res, cnt);
+    int axis = depth % k_dims, found = 0;
+    if (p[axis] <= t->split[node]) found = flat_delete_rec(t, 2 * node + 1, depth + 1, id, p);
+    if (!found && p[axis] >= t->split[node]) found = flat_delete_rec(t, 2 * node + 2, depth + 1, id, p);
+    if (found) flat_agg_node(t, node);
+    return found;
 }
 
-int check_lsh_bands(Movie *m1, Movie *m2) {
-    int bands = 5, rows = 4;
-    for (int b = 0; b < bands; b++) {
-        int match = 1;
-        for (int r = 0; r < rows; r++) {
-            if (m1->minhash_sig[b * rows + r] != m2->minhash_sig[b * rows + r]) { match = 0; break; }
+// Removes a movie indexed with its current coordinates; not for a tree mapped from a snapshot
+int delete_flatkd(FlatKD *t, int id) {
+    double p[MAX_DIMS];
+    agg_point(id, p);
+    if (!flat_delete_rec(t, 0, 0, id, p)) return 0;
+    if (++t->dead > TOMBSTONE_RATIO * t->n) {
+        int *ids = malloc((t->n > 0 ? t->n : 1) * sizeof(int)), n = 0;
+        for(int i=0; i<t->n; i++) {
+            if (t->ids[i] >= 0 && !db.deleted[t->ids[i]]) ids[n++] = t->ids[i];
         }
-        if (match) return 1;
+        free_flatkd(t);
+        build_flatkd(t, ids, n);
+        free(ids);
+    }
+    return 1;
+}
+
+void knn_flat_rec(FlatKD *t, int node, int depth, int target, KnnHeap *best) {
+    if (depth == t->levels) {
+        int leaf = node - (t->nleaves - 1);
+        int live[KD_BUCKET], m = 0;
+        for(int i=t->leaf_start[leaf]; i<t->leaf_start[leaf + 1]; i++) {
+            int id = t->ids[i];
+            if (id >= 0 && id != target && !db.deleted[id]) live[m++] = id;
+        }
+        knn_push_batch(best, target, live, m);
+        return;
+    }
+    int axis = depth % k_dims;
+    double diff = (db.col[axis][target] - t->split[node]) / dim_scale(axis);
+    int near = (diff < 0) ? 2 * node + 1 : 2 * node + 2;
+    int far = (diff < 0) ? 2 * node + 2 : 2 * node + 1;
+    knn_flat_rec(t, near, depth + 1, target, best);
+    if (fabs(diff) <= knn_heap_bound(best)) knn_flat_rec(t, far, depth + 1, target, best);
+}
+
+int knn_flatkd(FlatKD *t, int target, int k, Neighbor *out) {
+    KnnHeap best;
+    knn_heap_init(&best, out, k);
+    if (k > 0) knn_flat_rec(t, 0, 0, target, &best);
+    return knn_heap_finish(&best);
+}
+
+// Benchmark and demo for the flat variant (tree_kdtree.exe --flat)
+void run_flat(int total_n, int *ids, int *results, double minv[], double maxv[]) {
+    printf("\n=== k-d Tree, flat with leaf buckets (%d Dimensions) ===\n", k_dims);
+    printf("--------------------------------------------------------------------------\n");
+    printf("| Size         | Build (s) | Insert (s) | Query (s) | Memory (MB) |\n");
+    printf("--------------------------------------------------------------------------\n");
+
+    int step = 20000; 
+    for(int n = step; n <= total_n; n += step) {
+        for(int i=0; i<n; i++) ids[i] = i;
+        FlatKD t;
+
+        clock_t start = clock();
+        build_flatkd(&t, ids, n);
+        double build_time = (double)(clock()-start)/CLOCKS_PER_SEC;
+
+        double insert_time = 0.0; // Static layout, inserts mean a rebuild
+
+        int count = 0;
+        start = clock();
+        query_flatkd(&t, minv, maxv, results, &count);
+        double query_time = (double)(clock()-start)/CLOCKS_PER_SEC;
+
+        double mem_mb = flatkd_memory(&t) / (1024.0 * 1024.0);
+        printf("| %-12d | %-9.4f | %-10.4f | %-9.4f | %-11.2f |\n", n, build_time, insert_time, query_time, mem_mb);
+        free_flatkd(&t);
     }
+    printf("--------------------------------------------------------------------------\n");
+
+    FlatKD t;
+    for(int i=0; i<total_n; i++) ids[i] = i;
+    build_flatkd(&t, ids, total_n);
+
+    int count = 0;
+    query_flatkd(&t, minv, maxv, results, &count);
+    printf("\nQuery Found: %d movies\n", count);
+
+    if (count > 0) {
+        printf("\n[Delete Demo] Removing: '%s'\n", db.info[results[0]].title);
+        delete_flatkd(&t, results[0]);
+        db.deleted[results[0]] = 1;
+
+        printf("[Update Demo] Updating popularity...\n");
+        if (count > 1) {
+            int target = results[1];
+            double new_pop = db.col[1][target] + 15.0;
+            printf(" [Update] Moved '%s' (Pop: %.2f -> %.2f), rebuilding\n", db.info[target].title, db.col[1][target], new_pop);
+            store_set(target, 1, new_pop);
+            free_flatkd(&t);
+            build_flatkd(&t, ids, total_n);
+        }
+
+        int c2 = 0;
+        double t0 = wall_time();
+        query_flatkd(&t, minv, maxv, results, &c2);
+        double t1 = wall_time();
+        Agg agg;
+        agg_flatkd(&t, minv, maxv, &agg);
+        print_agg(&agg, wall_time() - t1, c2, t1 - t0);
+        if (c2 > 0) {
+            Neighbor nn[5];
+            int found = knn_flatkd(&t, results[0], 5, nn);
+            print_neighbors("kNN Flat k-d Tree - Full Dataset", results[0], nn, found);
+        }
+    }
+    free_flatkd(&t);
+}
+
+// --- Snapshot image: nodes in preorder, children by position ---
+typedef struct {
+    int id, axis;
+    int left, right; // -1 when absent
+} KDImageNode;
+
+int encode_kdtree(KDNode *node, KDImageNode *out, int *n) {
+    if (!node) return -1;
+    int i = (*n)++;
+    out[i].id = node->id;
+    out[i].axis = node->axis;
+    out[i].left = encode_kdtree(node->left, out, n);
+    out[i].right = encode_kdtree(node->right, out, n);
+    return i;
+}
+
+// Preorder puts both children after their parent, which also keeps walks finite
+int kd_image_valid(const KDImageNode *nodes, long long nnodes) {
+    for(long long i=0; i<nnodes; i++) {
+        const KDImageNode *n = &nodes[i];
+        if (n->id < 0 || n->id >= db.count || n->axis < 0 || n->axis >= k_dims) return 0;
+        if (n->left != -1 && (n->left <= i || n->left >= nnodes)) return 0;
+        if (n->right != -1 && (n->right <= i || n->right >= nnodes)) return 0;
+    }
+    return 1;
+}
+
+void query_kd_image(const KDImageNode *nodes, int i, double min[], double max[], int *res, int *cnt) {
+    if (i < 0) return;
+    int id = nodes[i].id, axis = nodes[i].axis;
+    if (!db.deleted[id] && point_in_box(id, min, max)) res[(*cnt)++] = id;
+    double val = db.col[axis][id];
+    if (val >= min[axis]) query_kd_image(nodes, nodes[i].left, min, max, res, cnt);
+    if (val <= max[axis]) query_kd_image(nodes, nodes[i].right, min, max, res, cnt);
+}
+
+// The flat tree is pointer-free already, so its arrays are written as they are
+int save_kd_snapshot(const char *path, int *ids, int n) {
+    for(int i=0; i<n; i++) ids[i] = i;
+    KDNode *root = build_kdtree(ids, n, 0);
+    KDImageNode *img = malloc((n > 0 ? n : 1) * sizeof(KDImageNode));
+    int nodes = 0;
+    encode_kdtree(root, img, &nodes);
+    for(int i=0; i<n; i++) ids[i] = i;
+    FlatKD flat;
+    build_flatkd(&flat, ids, n);
+
+    SnapWriter w;
+    int ok = snap_create(&w, path);
+    if (ok) {
+        snap_write(&w, "kd.nodes", img, nodes * sizeof(KDImageNode));
+        snap_write(&w, "kdflat.split", flat.split, (flat.nleaves - 1) * sizeof(double));
+        snap_write(&w, "kdflat.leaves", flat.leaf_start, (flat.nleaves + 1) * sizeof(int));
+        snap_write(&w, "kdflat.ids", flat.ids, n * sizeof(int));
+        snap_write(&w, "kdflat.coords", flat.coords, (long long)n * k_dims * sizeof(double));
+        snap_write(&w, "kdflat.agg", flat.agg, (2LL * flat.nleaves - 1) * sizeof(Agg));
+        ok = snap_finish(&w);
+        if (ok) printf("[Snapshot] Wrote %s\n", path);
+    }
+    free(img);
+    free_flatkd(&flat);
+    reset_kd_arena();
+    return ok;
+}
+
+// Points a FlatKD at the arrays of a mapped snapshot (do not free_flatkd it).
+// Returns 0 when a section is missing or its sizes and offsets do not fit.
+int flatkd_from_snapshot(FlatKD *t, Snapshot *s) {
+    long long nsplit, nleaves, n, ncoords, nagg;
+    t->split = snap_find(s, "kdflat.split", &nsplit);
+    t->leaf_start = snap_find(s, "kdflat.leaves", &nleaves);
+    t->ids = snap_find(s, "kdflat.ids", &n);
+    t->coords = snap_find(s, "kdflat.coords", &ncoords);
+    t->agg = snap_find(s, "kdflat.agg", &nagg);
+    if (!t->split || !t->leaf_start || !t->ids || !t->coords || !t->agg) return 0;
+    nleaves = nleaves / (long long)sizeof(int) - 1;
+    n /= (long long)sizeof(int);
+    if (nleaves < 1 || nleaves > (1 << 30) || (nleaves & (nleaves - 1)) != 0 || n > db.count) return 0;
+    if (nsplit < (nleaves - 1) * (long long)sizeof(double) || nagg < (2 * nleaves - 1) * (long long)sizeof(Agg)) return 0;
+    if (ncoords < n * k_dims * (long long)sizeof(double)) return 0;
+    // Buckets tile ids[] in order, so leaf_start runs from 0 to n
+    if (t->leaf_start[0] != 0 || t->leaf_start[nleaves] != n) return 0;
+    for(long long j=0; j<nleaves; j++) {
+        if (t->leaf_start[j + 1] < t->leaf_start[j]) return 0;
+    }
+    for(long long i=0; i<n; i++) {
+        if (t->ids[i] < -1 || t->ids[i] >= db.count) return 0;
+    }
+    t->nleaves = (int)nleaves;
+    t->n = (int)n;
+    t->dead = 0;
+    t->levels = 0;
+    while ((1 << t->levels) < t->nleaves) t->levels++;
+    return 1;
+}
+
+int run_kd_snapshot(const char *path) {
+    double t0 = wall_time();
+    Snapshot s;
+    if (!snap_open(&s, path)) return 1;
+    long long size;
+    const KDImageNode *nodes = snap_find(&s, "kd.nodes", &size);
+    FlatKD flat;
+    if (!nodes || !snap_find(&s, "kdflat.split", NULL)) {
+        printf("ERROR: %s holds no k-d tree.\n", path);
+        snap_close(&s);
+        return 1;
+    }
+    if (!kd_image_valid(nodes, size / (long long)sizeof(KDImageNode)) || !flatkd_from_snapshot(&flat, &s)) {
+        printf("ERROR: %s: corrupt k-d tree sections.\n", path);
+        snap_close(&s);
+        return 1;
+    }
+    double t1 = wall_time();
+
+    double minv[MAX_DIMS], maxv[MAX_DIMS];
+    demo_box(minv, maxv);
+    int *results = malloc((db.count > 0 ? db.count : 1) * sizeof(int));
+    int count = 0;
+    if (size >= (long long)sizeof(KDImageNode)) query_kd_image(nodes, 0, minv, maxv, results, &count);
+    double t2 = wall_time();
+    print_snapshot_demo(path, t1 - t0, t2 - t1, results, count);
+
+    int c_flat = 0;
+    query_flatkd(&flat, minv, maxv, results, &c_flat);
+    printf("Flat k-d Tree Query Found: %d movies in %.4fs\n", c_flat, wall_time() - t2);
+    free(results);
+    snap_close(&s);
     return 0;
 }
 
-int main() {
-    Movie *data = malloc(MAX_MOVIES * sizeof(Movie));
-    int total_n = load_csv("movies.csv", data);
-    
-    Movie **ptrs = malloc(total_n * sizeof(Movie*));
-    Movie **results = malloc(total_n * sizeof(Movie*));
+#ifndef TREE_NO_MAIN
+int main(int argc, char **argv) {
+    if (argc > 2 && strcmp(argv[1], "--snapshot") == 0) return run_kd_snapshot(argv[2]);
+    int total_n = load_csv("movies.csv");
     
-    // ΔΙΟΡΘΩΣΗ: Ασφαλής ορισμός ορίων για 2 διαστάσεις
-    double minv[K_DIMS], maxv[K_DIMS];
-    minv[0] = 1000; maxv[0] = 50000; 
+    int *ids = malloc(total_n * sizeof(int));
+    int *results = malloc(total_n * sizeof(int));
     
-    if (K_DIMS > 1) { minv[1] = 2;    maxv[1] = 50; }
-    if (K_DIMS > 2) { minv[2] = 60;   maxv[2] = 180; }
-    
-    for(int i=3; i<K_DIMS; i++) { minv[i] = -1e9; maxv[i] = 1e9; }
+    double minv[MAX_DIMS], maxv[MAX_DIMS];
+    demo_box(minv, maxv);
 
-    printf("\n=== k-d Tree (%d Dimensions) ===\n", K_DIMS);
+    if (argc > 2 && strcmp(argv[1], "--save-snapshot") == 0) {
+        int ok = save_kd_snapshot(argv[2], ids, total_n);
+        store_free(); free(ids); free(results);
+        return ok ? 0 : 1;
+    }
+
+    if (argc > 1 && strcmp(argv[1], "--flat") == 0) {
+        run_flat(total_n, ids, results, minv, maxv);
+        store_free(); free(ids); free(results);
+        return 0;
+    }
+
+    printf("\n=== k-d Tree (%d Dimensions) ===\n", k_dims);
     printf("--------------------------------------------------------------------------\n");
     printf("| Size         | Build (s) | Insert (s) | Query (s) | Memory (MB) |\n");
     printf("--------------------------------------------------------------------------\n");
 
     int step = 20000; 
     for(int n = step; n <= total_n; n += step) {
-        for(int i=0; i<n; i++) ptrs[i] = &data[i];
+        for(int i=0; i<n; i++) ids[i] = i;
 
+        // The last movie is left out of the build and inserted on its own
         clock_t start = clock();
-        KDNode *root = build_kdtree(ptrs, n, 0);
+        KDNode *root = build_kdtree(ids, n - 1, 0);
         double build_time = (double)(clock()-start)/CLOCKS_PER_SEC;
 
         start = clock();
-        insert_kdtree(root, &data[n-1], 0);
+        root = insert_kdtree(root, n - 1, 0);
         double insert_time = (double)(clock()-start)/CLOCKS_PER_SEC;
 
         int count = 0;
@@ -137,55 +737,96 @@ int main() {
         query_kdtree(root, minv, maxv, results, &count);
         double query_time = (double)(clock()-start)/CLOCKS_PER_SEC;
         
-        long nodes = count_nodes(root);
-        double mem_mb = (nodes * sizeof(KDNode)) / (1024.0 * 1024.0);
+        double mem_mb = get_kd_memory(root) / (1024.0 * 1024.0);
         
         printf("| %-12d | %-9.4f | %-10.4f | %-9.4f | %-11.2f |\n", n, build_time, insert_time, query_time, mem_mb);
-        free_kdtree(root);
+        reset_kd_arena();
     }
     printf("--------------------------------------------------------------------------\n");
     fflush(stdout);
 
     // FULL DEMO
-    for(int i=0; i<total_n; i++) ptrs[i] = &data[i];
-    KDNode *root = build_kdtree(ptrs, total_n, 0);
+    for(int i=0; i<total_n; i++) ids[i] = i;
+    KDNode *root = build_kdtree(ids, total_n, 0);
 
     int count = 0;
     query_kdtree(root, minv, maxv, results, &count);
     printf("\nQuery Found: %d movies\n", count);
+    // Wide box matching the whole catalog, sequential vs parallel. These
+    // timings get their own buffer; results keeps the demo box for below.
+    int *scratch = malloc((db.count > 0 ? db.count : 1) * sizeof(int));
+    double wmin[MAX_DIMS], wmax[MAX_DIMS];
+    for(int i=0; i<k_dims; i++) { wmin[i] = -INFINITY; wmax[i] = INFINITY; }
+    int c_seq = 0, c_par = 0;
+    query_pool_start();
+    double t0 = wall_time();
+    query_kdtree(root, wmin, wmax, scratch, &c_seq);
+    double t1 = wall_time();
+    query_kdtree_par(root, wmin, wmax, scratch, &c_par);
+    double t2 = wall_time();
+    printf("[Parallel Query] Wide box: %d movies in %.4fs on 1 thread, %d movies in %.4fs on %d threads\n",
+           c_seq, t1 - t0, c_par, t2 - t1, qpool.nthreads);
+
+    // A page of boxes answered in one batched traversal vs one query each
+    int nbox = 200;
+    double (*bmin)[MAX_DIMS] = malloc(nbox * sizeof(*bmin)), (*bmax)[MAX_DIMS] = malloc(nbox * sizeof(*bmax));
+    random_boxes(bmin, bmax, nbox, 42);
+    BoxBatch batch;
+    batch_init(&batch, bmin, bmax, nbox);
+    t0 = wall_time();
+    query_kdtree_batch(root, &batch);
+    t1 = wall_time();
+    int c_single = 0;
+    for(int i=0; i<nbox; i++) {
+        int c = 0;
+        query_kdtree(root, bmin[i], bmax[i], scratch, &c);
+        c_single += c;
+    }
+    t2 = wall_time();
+    int c_batch = 0;
+    for(int i=0; i<nbox; i++) c_batch += batch.cnt[i];
+    printf("[Batch Query] %d boxes: %d matches in %.4fs batched, %d matches in %.4fs one by one\n",
+           nbox, c_batch, t1 - t0, c_single, t2 - t1);
+    batch_free(&batch);
+    free(bmin); free(bmax); free(scratch);
     
     if (count > 0) {
-        printf("\n[Delete Demo] Removing: '%s'\n", results[0]->title);
-        results[0]->is_deleted = 1;
+        printf("\n[Delete Demo] Removing: '%s'\n", db.info[results[0]].title);
+        delete_kdtree(&root, results[0]);
+        db.deleted[results[0]] = 1;
         fflush(stdout);
         
         printf("[Update Demo] Updating popularity...\n");
         fflush(stdout);
         
-        if(count > 1) update_kdtree(&root, results[1], results[1]->values[1] + 15.0);
+        if(count > 1) update_kdtree(&root, results[1], db.col[1][results[1]] + 15.0);
         
         int c2 = 0;
+        t0 = wall_time();
         query_kdtree(root, minv, maxv, results, &c2);
+        t1 = wall_time();
+        Agg agg;
+        agg_kdtree(root, minv, maxv, &agg);
+        print_agg(&agg, wall_time() - t1, c2, t1 - t0);
         
-        if (c2 > 0) run_knn(results[0], results, c2, 5);
+        if (c2 > 0) {
+            Neighbor nn[5];
+            int found = run_knn(results[0], results, c2, 5, nn);
+            print_neighbors("kNN Search", results[0], nn, found);
+
+            found = knn_kdtree(root, results[0], 5, nn);
+            print_neighbors("kNN k-d Tree - Full Dataset", results[0], nn, found);
+        }
 
         if (c2 > 0) {
-            printf("\n[LSH Similarity - Banding] Target: %s\n", results[0]->title);
-            printf("(Showing candidates that collide in at least 1 band)\n");
-            int found_sim = 0;
-            for(int i=1; i<c2 && i<1000; i++) { 
-                if (check_lsh_bands(results[0], results[i])) {
-                    double sim = jaccard_similarity(results[0], results[i]);
-                    if (sim > 0.3) {
-                        printf(" -> Candidate: %s (Jaccard: %.2f)\n", results[i]->title, sim);
-                        found_sim++;
-                    }
-                }
-            }
-            if (found_sim == 0) printf("No similar text features found in query results.\n");
+            LshIndex lsh;
+            lsh_build(&lsh, db.count);
+            print_lsh_similar(&lsh, results[0], 0.3);
+            lsh_free(&lsh);
         }
     }
-    free_kdtree(root);
-    free(data); free(ptrs); free(results);
+    reset_kd_arena();
+    store_free(); free(ids); free(results);
     return 0;
-}
\ No newline at end of file
+}
+#endif
@@ -1,168 +1,535 @@
 #include "movies_common.h"
 
-#define MAX_CHILDREN (1 << K_DIMS) 
 #define MAX_DEPTH 30 
+#define LEAF_CAP 50
 
+// Leaves and internal nodes share this header and differ in shape
 typedef struct QuadNode {
-    double min[K_DIMS], max[K_DIMS]; 
-    Movie *movies[50];     
-    int count;
-    struct QuadNode *children[MAX_CHILDREN]; 
+    double min[MAX_DIMS], max[MAX_DIMS]; 
     int is_leaf;
+    int count; // Leaf: ids stored. Internal: children allocated.
 } QuadNode;
 
+typedef struct QuadLeaf {
+    QuadNode hdr;
+    int ids[LEAF_CAP];
+    struct QuadLeaf *overflow; // Spill bucket once the leaf is full below MAX_DEPTH
+} QuadLeaf;
+
+// Only non-empty quadrants get a child. Bit q of `occupied` marks quadrant q,
+// and its child sits at index popcount(occupied below q) of children[].
+typedef struct {
+    QuadNode hdr;
+    unsigned int occupied;
+    Agg agg; // Live movies below; leaves and their buckets are scanned instead
+    QuadNode *children[];
+} QuadInternal;
+
+Arena quad_arena; // Every leaf, bucket and internal node lives here
+
 // RAM Calculation
 long get_quad_memory(QuadNode *n) {
     if (!n) return 0;
-    long size = sizeof(QuadNode);
-    if (!n->is_leaf) {
-        for(int i=0; i<MAX_CHILDREN; i++) size += get_quad_memory(n->children[i]);
+    if (n->is_leaf) {
+        QuadLeaf *leaf = (QuadLeaf*)n;
+        return sizeof(QuadLeaf) + get_quad_memory((QuadNode*)leaf->overflow);
     }
+    long size = sizeof(QuadInternal) + n->count * sizeof(QuadNode*);
+    for(int i=0; i<n->count; i++) size += get_quad_memory(((QuadInternal*)n)->children[i]);
     return size;
 }
 
-int check_lsh_bands(Movie *m1, Movie *m2) {
-    int bands = 5, rows = 4;
-    for (int b = 0; b < bands; b++) {
-        int match = 1;
-        for (int r = 0; r < rows; r++) {
-            if (m1->minhash_sig[b * rows + r] != m2->minhash_sig[b * rows + r]) { match = 0; break; }
+QuadNode* create_node(double *min_c, double *max_c) {
+    QuadLeaf *leaf = arena_alloc(&quad_arena, sizeof(QuadLeaf));
+    for(int i=0; i<k_dims; i++) {
+        leaf->hdr.min[i] = min_c[i];
+        leaf->hdr.max[i] = max_c[i];
+    }
+    leaf->hdr.count = 0; leaf->hdr.is_leaf = 1;
+    leaf->overflow = NULL;
+    return &leaf->hdr;
+}
+
+// O(1) in the node count: frees every node of the arena, so the tree in
+// use is gone and the next build starts fresh
+void reset_quad_arena(void) {
+    arena_free(&quad_arena);
+}
+
+int is_inside(int id, double *min, double *max) {
+    return point_in_box(id, min, max);
+}
+
+int quadrant_of(QuadNode *n, int id) {
+    int q = 0;
+    for(int d=0; d<k_dims; d++) {
+        if (db.col[d][id] >= (n->min[d] + n->max[d]) / 2.0) q |= (1 << d);
+    }
+    return q;
+}
+
+// Live movies of a subtree into a
+void quad_agg_of(QuadNode *n, Agg *a) {
+    if (!n->is_leaf) { agg_merge(a, &((QuadInternal*)n)->agg); return; }
+    for(QuadLeaf *leaf = (QuadLeaf*)n; leaf; leaf = leaf->overflow) {
+        for(int i=0; i<leaf->hdr.count; i++) agg_add(a, leaf->ids[i]);
+    }
+}
+
+// Returns the node that now stands where n stood: a full leaf turns into an
+// internal node, and an internal node is reallocated when it gains a child
+QuadNode* insert_quad(QuadNode *n, int id, int depth) {
+    if (n->is_leaf) {
+        QuadLeaf *leaf = (QuadLeaf*)n;
+        if (n->count < LEAF_CAP) { leaf->ids[n->count++] = id; return n; }
+        if (depth > MAX_DEPTH) {
+            // Too deep to split (e.g. many equal points): chain a bucket
+            if (!leaf->overflow) leaf->overflow = (QuadLeaf*)create_node(n->min, n->max);
+            leaf->overflow = (QuadLeaf*)insert_quad(&leaf->overflow->hdr, id, depth);
+            return n;
         }
-        if (match) return 1;
+        QuadInternal *in = arena_alloc(&quad_arena, sizeof(QuadInternal));
+        memcpy(in->hdr.min, n->min, sizeof(n->min));
+        memcpy(in->hdr.max, n->max, sizeof(n->max));
+        in->hdr.is_leaf = 0; in->hdr.count = 0;
+        agg_clear(&in->agg);
+        in->occupied = 0;
+        QuadNode *node = &in->hdr;
+        for(int k=0; k<leaf->hdr.count; k++) node = insert_quad(node, leaf->ids[k], depth);
+        arena_release(&quad_arena, leaf, sizeof(QuadLeaf));
+        return insert_quad(node, id, depth);
     }
-    return 0;
+    
+    QuadInternal *in = (QuadInternal*)n;
+    int q = quadrant_of(n, id);
+    int slot = __builtin_popcount(in->occupied & ((1u << q) - 1));
+    if (!(in->occupied & (1u << q))) {
+        in = arena_realloc(&quad_arena, in, sizeof(QuadInternal) + in->hdr.count * sizeof(QuadNode*),
+                           sizeof(QuadInternal) + (in->hdr.count + 1) * sizeof(QuadNode*));
+        memmove(&in->children[slot + 1], &in->children[slot], (in->hdr.count - slot) * sizeof(QuadNode*));
+        double c_min[MAX_DIMS], c_max[MAX_DIMS];
+        for(int d=0; d<k_dims; d++) {
+            double mid = (in->hdr.min[d] + in->hdr.max[d]) / 2.0;
+            if ((q >> d) & 1) { c_min[d] = mid; c_max[d] = in->hdr.max[d]; }
+            else { c_min[d] = in->hdr.min[d]; c_max[d] = mid; }
+        }
+        in->children[slot] = create_node(c_min, c_max);
+        in->occupied |= 1u << q;
+        in->hdr.count++;
+    }
+    agg_add(&in->agg, id);
+    in->children[slot] = insert_quad(in->children[slot], id, depth + 1);
+    return &in->hdr;
 }
 
-QuadNode* create_node(double *min_c, double *max_c) {
-    QuadNode *n = malloc(sizeof(QuadNode));
-    for(int i=0; i<K_DIMS; i++) {
-        n->min[i] = min_c[i];
-        n->max[i] = max_c[i];
+// Grows the root box (doubling towards the point) until it contains id, so
+// inserts outside the data-derived bounds are not lost. Use for every insert at the root.
+// build_quad gives every dimension a nonzero width, so the old root's box is
+// exactly the quadrant it takes in the new one.
+QuadNode* insert_quad_root(QuadNode *root, int id) {
+    while (!is_inside(id, root->min, root->max)) {
+        QuadInternal *in = arena_alloc(&quad_arena, sizeof(QuadInternal) + sizeof(QuadNode*));
+        int q = 0;
+        for(int d=0; d<k_dims; d++) {
+            double w = root->max[d] - root->min[d];
+            if (db.col[d][id] < root->min[d]) {
+                in->hdr.min[d] = root->min[d] - w; in->hdr.max[d] = root->max[d];
+                q |= (1 << d); // Old root is the upper half
+            } else {
+                in->hdr.min[d] = root->min[d]; in->hdr.max[d] = root->max[d] + w;
+            }
+        }
+        in->hdr.is_leaf = 0; in->hdr.count = 1;
+        agg_clear(&in->agg);
+        quad_agg_of(root, &in->agg);
+        in->occupied = 1u << q;
+        in->children[0] = root;
+        root = &in->hdr;
     }
-    n->count = 0; n->is_leaf = 1;
-    for(int i=0; i<MAX_CHILDREN; i++) n->children[i] = NULL;
-    return n;
+    return insert_quad(root, id, 0);
 }
 
-void free_quad(QuadNode *n) {
-    if (!n) return;
-    if (!n->is_leaf) {
-        for(int i=0; i<MAX_CHILDREN; i++) free_quad(n->children[i]);
+// --- Morton-order bulk loading ---
+// An MSD radix sort on Z-order digits: at each node one pass computes every
+// movie's quadrant (its next k_dims-bit Morton digit) and a counting sort
+// groups them, so the ids end up in Morton order and each run of equal digits
+// becomes one child, allocated once with the exact child count.
+QuadNode* build_quad_rec(int *ids, int *tmp, unsigned char *dig, int n,
+                         double *min, double *max, int depth) {
+    if (n <= LEAF_CAP || depth > MAX_DEPTH) {
+        QuadNode *leaf = create_node(min, max);
+        for(int i=0; i<n; i++) leaf = insert_quad(leaf, ids[i], depth); // Overflow past MAX_DEPTH
+        return leaf;
+    }
+    QuadNode box;
+    memcpy(box.min, min, sizeof(box.min));
+    memcpy(box.max, max, sizeof(box.max));
+    int start[(1 << MAX_DIMS) + 1];
+    memset(start, 0, sizeof(start));
+    for(int i=0; i<n; i++) {
+        dig[i] = (unsigned char)quadrant_of(&box, ids[i]);
+        start[dig[i] + 1]++;
     }
-    free(n);
+    int children = 0;
+    for(int q=0; q<(1 << k_dims); q++) {
+        if (start[q + 1] > 0) children++;
+        start[q + 1] += start[q];
+    }
+    int pos[1 << MAX_DIMS];
+    memcpy(pos, start, sizeof(pos));
+    for(int i=0; i<n; i++) tmp[pos[dig[i]]++] = ids[i];
+    memcpy(ids, tmp, n * sizeof(int));
+
+    QuadInternal *in = arena_alloc(&quad_arena, sizeof(QuadInternal) + children * sizeof(QuadNode*));
+    in->hdr = box;
+    in->hdr.is_leaf = 0; in->hdr.count = 0;
+    agg_clear(&in->agg);
+    in->occupied = 0;
+    for(int q=0; q<(1 << k_dims); q++) {
+        int len = start[q + 1] - start[q];
+        if (len == 0) continue;
+        double c_min[MAX_DIMS], c_max[MAX_DIMS];
+        for(int d=0; d<k_dims; d++) {
+            double mid = (min[d] + max[d]) / 2.0;
+            if ((q >> d) & 1) { c_min[d] = mid; c_max[d] = max[d]; }
+            else { c_min[d] = min[d]; c_max[d] = mid; }
+        }
+        in->children[in->hdr.count++] = build_quad_rec(ids + start[q], tmp + start[q], dig + start[q], len,
+                                                       c_min, c_max, depth + 1);
+        quad_agg_of(in->children[in->hdr.count - 1], &in->agg);
+        in->occupied |= 1u << q;
+    }
+    return &in->hdr;
+}
+
+// Root bounds come from the data instead of a fixed -1000 .. 1e10 box
+QuadNode* build_quad(int *ids, int n) {
+    double min[MAX_DIMS], max[MAX_DIMS];
+    for(int d=0; d<k_dims; d++) { min[d] = 0.0; max[d] = 1.0; }
+    for(int i=0; i<n; i++) {
+        for(int d=0; d<k_dims; d++) {
+            double v = db.col[d][ids[i]];
+            if (i == 0 || v < min[d]) min[d] = v;
+            if (i == 0 || v > max[d]) max[d] = v;
+        }
+    }
+    // A single movie or a constant column would give a zero-width box, whose
+    // quadrants could not hold later inserts
+    for(int d=0; d<k_dims; d++) {
+        if (max[d] <= min[d]) max[d] = min[d] + (fabs(min[d]) > 1.0 ? fabs(min[d]) : 1.0);
+    }
+    int *tmp = malloc((n > 0 ? n : 1) * sizeof(int));
+    unsigned char *dig = malloc(n > 0 ? n : 1);
+    QuadNode *root = build_quad_rec(ids, tmp, dig, n, min, max, 0);
+    free(tmp); free(dig);
+    return root;
+}
+
+// --- Subtree aggregates ---
+void quad_agg_recompute(QuadInternal *in) {
+    agg_clear(&in->agg);
+    for(int i=0; i<in->hdr.count; i++) quad_agg_of(in->children[i], &in->agg);
 }
 
-int is_inside(Movie *m, double *min, double *max) {
-    for(int i=0; i<K_DIMS; i++) {
-        if (m->values[i] < min[i] || m->values[i] > max[i]) return 0;
+// --- Deletes ---
+// A movie is taken out of its bucket for real (the chain's last id fills the
+// hole), empty children are dropped and an internal node whose live movies
+// fall to LEAF_CAP / 2 collapses back into one leaf, so the tree shrinks with
+// the catalog instead of keeping dead entries around.
+int quad_leaf_remove(QuadLeaf *leaf, int id) {
+    QuadLeaf *b;
+    int i = 0;
+    for(b = leaf; b; b = b->overflow) {
+        for(i=0; i<b->hdr.count && b->ids[i] != id; i++);
+        if (i < b->hdr.count) break;
+    }
+    if (!b) return 0;
+    QuadLeaf *prev = NULL, *tail = leaf;
+    while (tail->overflow) { prev = tail; tail = tail->overflow; }
+    b->ids[i] = tail->ids[--tail->hdr.count];
+    if (tail->hdr.count == 0 && prev) {
+        prev->overflow = NULL;
+        arena_release(&quad_arena, tail, sizeof(QuadLeaf));
     }
     return 1;
 }
 
-void insert_quad(QuadNode *n, Movie *m, int depth) {
+// Live ids of the subtree into ids[]; its nodes go back to the arena
+void quad_collect(QuadNode *n, int *ids, int *m) {
     if (n->is_leaf) {
-        if (n->count < 50 || depth > MAX_DEPTH) {
-            if(n->count < 50) n->movies[n->count++] = m;
-            return;
-        }
-        n->is_leaf = 0;
-        double mid[K_DIMS];
-        for(int d=0; d<K_DIMS; d++) mid[d] = (n->min[d] + n->max[d]) / 2.0;
-        
-        for(int i=0; i<MAX_CHILDREN; i++) {
-            double c_min[K_DIMS], c_max[K_DIMS];
-            for(int d=0; d<K_DIMS; d++) {
-                if ((i >> d) & 1) { 
-                    c_min[d] = mid[d]; c_max[d] = n->max[d]; 
-                } else { 
-                    c_min[d] = n->min[d]; c_max[d] = mid[d]; 
-                }
+        QuadLeaf *leaf = (QuadLeaf*)n;
+        while (leaf) {
+            QuadLeaf *next = leaf->overflow;
+            for(int i=0; i<leaf->hdr.count; i++) {
+                if (!db.deleted[leaf->ids[i]]) ids[(*m)++] = leaf->ids[i];
             }
-            n->children[i] = create_node(c_min, c_max);
+            arena_release(&quad_arena, leaf, sizeof(QuadLeaf));
+            leaf = next;
         }
-        
-        for(int k=0; k<n->count; k++) {
-            Movie *old_m = n->movies[k];
-            int child_idx = 0;
-            for(int d=0; d<K_DIMS; d++) {
-                if (old_m->values[d] >= mid[d]) child_idx |= (1 << d);
+        return;
+    }
+    for(int i=0; i<n->count; i++) quad_collect(((QuadInternal*)n)->children[i], ids, m);
+    arena_release(&quad_arena, n, sizeof(QuadInternal) + n->count * sizeof(QuadNode*));
+}
+
+int quad_delete_rec(QuadNode **link, int id, int depth) {
+    QuadNode *n = *link;
+    if (n->is_leaf) return quad_leaf_remove((QuadLeaf*)n, id);
+    // Every child whose box holds the point is tried: a point on the upper
+    // edge of a root grown by insert_quad_root sits in the lower quadrant
+    QuadInternal *in = (QuadInternal*)n;
+    int slot = 0, q = -1;
+    for(int k=0; k<(1 << k_dims) && q < 0; k++) {
+        if (!(in->occupied & (1u << k))) continue;
+        QuadNode *c = in->children[slot];
+        if (is_inside(id, c->min, c->max) && quad_delete_rec(&in->children[slot], id, depth + 1)) q = k;
+        else slot++;
+    }
+    if (q < 0) return 0;
+
+    QuadNode *c = in->children[slot];
+    if (c->is_leaf && c->count == 0) {
+        arena_release(&quad_arena, c, sizeof(QuadLeaf));
+        memmove(&in->children[slot], &in->children[slot + 1], (in->hdr.count - slot - 1) * sizeof(QuadNode*));
+        in = arena_realloc(&quad_arena, in, sizeof(QuadInternal) + in->hdr.count * sizeof(QuadNode*),
+                           sizeof(QuadInternal) + (in->hdr.count - 1) * sizeof(QuadNode*));
+        in->occupied &= ~(1u << q);
+        in->hdr.count--;
+        *link = &in->hdr;
+    }
+    if (!agg_remove(&in->agg, id)) quad_agg_recompute(in);
+    if (in->agg.count <= LEAF_CAP / 2) {
+        int ids[LEAF_CAP], m = 0;
+        double min[MAX_DIMS], max[MAX_DIMS];
+        memcpy(min, in->hdr.min, sizeof(min));
+        memcpy(max, in->hdr.max, sizeof(max));
+        quad_collect(&in->hdr, ids, &m);
+        QuadNode *leaf = create_node(min, max);
+        for(int i=0; i<m; i++) leaf = insert_quad(leaf, ids[i], depth);
+        *link = leaf;
+    }
+    return 1;
+}
+
+// Removes a movie; call it while the movie still has the coordinates it was
+// inserted with. Returns 0 when it is not in the tree.
+int delete_quad(QuadNode **root, int id) {
+    if (!*root || !is_inside(id, (*root)->min, (*root)->max)) return 0;
+    return quad_delete_rec(root, id, 0);
+}
+
+void update_quad(QuadNode **root, int target, double new_pop) {
+    printf(" [Update] Moved '%s' (Pop: %.2f -> %.2f)\n", db.info[target].title, db.col[1][target], new_pop);
+    delete_quad(root, target);
+    store_set(target, 1, new_pop);
+    *root = insert_quad_root(*root, target);
+}
+
+void query_quad(QuadNode *n, double min[], double max[], int *res, int *cnt) {
+    if (!n || !box_overlaps(n->min, n->max, min, max)) return;
+
+    if (n->is_leaf) {
+        for(QuadLeaf *leaf = (QuadLeaf*)n; leaf; leaf = leaf->overflow) {
+            for(int i=0; i<leaf->hdr.count; i++) {
+                int id = leaf->ids[i];
+                if (!db.deleted[id] && point_in_box(id, min, max)) res[(*cnt)++] = id;
             }
-            insert_quad(n->children[child_idx], old_m, depth + 1);
         }
-        n->count = 0;
+    } else {
+        for(int i=0; i<n->count; i++) query_quad(((QuadInternal*)n)->children[i], min, max, res, cnt);
     }
-    
+}
+
+// Count/sum/min/max over the box without listing the movies
+void agg_quad_rec(QuadNode *n, double min[], double max[], Agg *out) {
+    if (!box_overlaps(n->min, n->max, min, max)) return;
     if (!n->is_leaf) {
-        double mid[K_DIMS];
-        for(int d=0; d<K_DIMS; d++) mid[d] = (n->min[d] + n->max[d]) / 2.0;
-        int child_idx = 0;
-        for(int d=0; d<K_DIMS; d++) {
-            if (m->values[d] >= mid[d]) child_idx |= (1 << d);
+        Agg *a = &((QuadInternal*)n)->agg;
+        if (agg_disjoint(a, min, max)) return;
+        if (agg_inside(a, min, max)) { agg_merge(out, a); return; }
+    }
+    if (n->is_leaf) {
+        for(QuadLeaf *leaf = (QuadLeaf*)n; leaf; leaf = leaf->overflow) {
+            for(int i=0; i<leaf->hdr.count; i++) {
+                if (point_in_box(leaf->ids[i], min, max)) agg_add(out, leaf->ids[i]);
+            }
         }
-        insert_quad(n->children[child_idx], m, depth + 1);
+    } else {
+        for(int i=0; i<n->count; i++) agg_quad_rec(((QuadInternal*)n)->children[i], min, max, out);
     }
 }
 
-void update_quad(QuadNode *root, Movie *target, double new_pop) {
-    printf(" [Update] Moved '%s' (Pop: %.2f -> %.2f)\n", target->title, target->values[1], new_pop);
-    target->values[1] = new_pop;
+void agg_quad(QuadNode *root, double min[], double max[], Agg *out) {
+    agg_clear(out);
+    if (root) agg_quad_rec(root, min, max, out);
+}
+
+// --- Parallel query: tasks are the subtrees below the first few levels ---
+void quad_query_task(QueryTask *t, double min[], double max[], int *res, int *cnt) {
+    query_quad(t->node, min, max, res, cnt);
 }
 
-void query_quad(QuadNode *n, double min[], double max[], Movie **res, int *cnt) {
-    if (!n) return;
-    for(int i=0; i<K_DIMS; i++) {
-        if (n->max[i] < min[i] || n->min[i] > max[i]) return;
+int quad_query_expand(QueryTask *t, double min[], double max[], QueryTaskList *out, int *res, int *cnt) {
+    (void)res; (void)cnt; // Internal nodes hold no movies to report
+    QuadNode *n = t->node;
+    if (!box_overlaps(n->min, n->max, min, max)) return 1;
+    if (n->is_leaf) return 0;
+    for(int i=0; i<n->count; i++) task_push(out, ((QuadInternal*)n)->children[i], 0);
+    return 1;
+}
+
+// --- Batched query: one traversal for a set of boxes ---
+void batch_quad(QuadNode *n, BoxBatch *b, int act, int nact) {
+    int off = batch_reserve(b, nact), m = 0;
+    for(int i=0; i<nact; i++) {
+        int box = b->stack[act + i];
+        if (box_overlaps(n->min, n->max, b->min[box], b->max[box])) b->stack[off + m++] = box;
     }
+    if (m > 0) {
+        if (n->is_leaf) {
+            for(QuadLeaf *leaf = (QuadLeaf*)n; leaf; leaf = leaf->overflow) {
+                batch_report_ids(b, leaf->ids, leaf->hdr.count, off, m);
+            }
+        } else {
+            for(int i=0; i<n->count; i++) batch_quad(((QuadInternal*)n)->children[i], b, off, m);
+        }
+    }
+    b->top = off;
+}
 
+void query_quad_batch(QuadNode *root, BoxBatch *b) {
+    if (!root) return;
+    int act = batch_all(b);
+    batch_quad(root, b, act, b->nboxes);
+    b->top = act;
+}
+
+void query_quad_par(QuadNode *root, double min[], double max[], int *res, int *cnt) {
+    if (!root) return;
+    QueryTask t = { root, 0 };
+    query_parallel(t, quad_query_expand, quad_query_task, min, max, res, cnt);
+}
+
+// --- Snapshot image: BFS box tree, a leaf's overflow chain folded into it ---
+void quad_image_size(QuadNode *n, int *nodes, int *ids) {
+    (*nodes)++;
     if (n->is_leaf) {
-        for(int i=0; i<n->count; i++) {
-            Movie *m = n->movies[i];
-            if (!m->is_deleted) {
-                int match = 1;
-                for(int d=0; d<K_DIMS; d++) {
-                    if (m->values[d] < min[d] || m->values[d] > max[d]) { match = 0; break; }
-                }
-                if (match) res[(*cnt)++] = m;
+        for(QuadLeaf *leaf = (QuadLeaf*)n; leaf; leaf = leaf->overflow) *ids += leaf->hdr.count;
+    } else {
+        for(int i=0; i<n->count; i++) quad_image_size(((QuadInternal*)n)->children[i], nodes, ids);
+    }
+}
+
+void encode_quad(QuadNode *root, BoxImageNode *nodes, int nnodes, int *ids) {
+    QuadNode **queue = malloc(nnodes * sizeof(QuadNode*)); // Source of every image slot
+    int tail = 0, nid = 0;
+    queue[tail++] = root;
+    for(int head=0; head<tail; head++) {
+        QuadNode *n = queue[head];
+        BoxImageNode *img = &nodes[head];
+        memcpy(img->min, n->min, sizeof(img->min));
+        memcpy(img->max, n->max, sizeof(img->max));
+        img->is_leaf = n->is_leaf;
+        img->pad = 0;
+        if (n->is_leaf) {
+            img->first = nid;
+            for(QuadLeaf *leaf = (QuadLeaf*)n; leaf; leaf = leaf->overflow) {
+                for(int i=0; i<leaf->hdr.count; i++) ids[nid++] = leaf->ids[i];
             }
+            img->count = nid - img->first;
+        } else {
+            img->first = tail;
+            img->count = n->count;
+            for(int i=0; i<n->count; i++) queue[tail++] = ((QuadInternal*)n)->children[i];
         }
-    } else {
-        for(int i=0; i<MAX_CHILDREN; i++) query_quad(n->children[i], min, max, res, cnt);
     }
+    free(queue);
 }
 
-int main() {
-    Movie *data = malloc(MAX_MOVIES * sizeof(Movie));
-    int total_n = load_csv("movies.csv", data);
-    Movie **results = malloc(total_n * sizeof(Movie*));
-    
-    double root_min[K_DIMS], root_max[K_DIMS];
-    for(int i=0; i<K_DIMS; i++) { 
-        root_min[i] = -1000.0;     
-        root_max[i] = 10000000000.0; 
+int save_quad_snapshot(const char *path, int *ids, int n) {
+    for(int i=0; i<n; i++) ids[i] = i;
+    QuadNode *root = build_quad(ids, n);
+    int nnodes = 0, nids = 0;
+    if (root) quad_image_size(root, &nnodes, &nids);
+    BoxImageNode *nodes = malloc((nnodes > 0 ? nnodes : 1) * sizeof(BoxImageNode));
+    int *img_ids = malloc((nids > 0 ? nids : 1) * sizeof(int));
+    if (root) encode_quad(root, nodes, nnodes, img_ids);
+
+    SnapWriter w;
+    int ok = snap_create(&w, path);
+    if (ok) {
+        snap_write(&w, "quad.nodes", nodes, nnodes * sizeof(BoxImageNode));
+        snap_write(&w, "quad.ids", img_ids, nids * sizeof(int));
+        ok = snap_finish(&w);
+        if (ok) printf("[Snapshot] Wrote %s\n", path);
+    }
+    free(nodes); free(img_ids);
+    reset_quad_arena();
+    return ok;
+}
+
+int run_quad_snapshot(const char *path) {
+    double t0 = wall_time();
+    Snapshot s;
+    if (!snap_open(&s, path)) return 1;
+    long long size, nids;
+    const BoxImageNode *nodes = snap_find(&s, "quad.nodes", &size);
+    const int *ids = snap_find(&s, "quad.ids", &nids);
+    if (!nodes || !ids) {
+        printf("ERROR: %s holds no quadtree.\n", path);
+        snap_close(&s);
+        return 1;
+    }
+    if (!box_image_valid(nodes, size / (long long)sizeof(BoxImageNode), ids, nids / (long long)sizeof(int))) {
+        printf("ERROR: %s: corrupt quadtree sections.\n", path);
+        snap_close(&s);
+        return 1;
     }
+    double t1 = wall_time();
+
+    double minv[MAX_DIMS], maxv[MAX_DIMS];
+    demo_box(minv, maxv);
+    int *results = malloc((db.count > 0 ? db.count : 1) * sizeof(int));
+    int count = 0;
+    if (size >= (long long)sizeof(BoxImageNode)) query_box_image(nodes, ids, 0, minv, maxv, results, &count);
+    print_snapshot_demo(path, t1 - t0, wall_time() - t1, results, count);
+    free(results);
+    snap_close(&s);
+    return 0;
+}
+
+#ifndef TREE_NO_MAIN
+int main(int argc, char **argv) {
+    if (argc > 2 && strcmp(argv[1], "--snapshot") == 0) return run_quad_snapshot(argv[2]);
+    int total_n = load_csv("movies.csv");
+    int *ids = malloc(total_n * sizeof(int));
+    int *results = malloc(total_n * sizeof(int));
     
-    // ΔΙΟΡΘΩΣΗ ΓΙΑ 2D
-    double minv[K_DIMS], maxv[K_DIMS];
-    minv[0] = 1000; maxv[0] = 50000; 
-    if (K_DIMS > 1) { minv[1] = 2;    maxv[1] = 50; }
-    if (K_DIMS > 2) { minv[2] = 60;   maxv[2] = 180; }
-    for(int i=3; i<K_DIMS; i++) { minv[i] = -1e9; maxv[i] = 1e9; }
-
-    printf("\n=== Generalized Quadtree (%d-D Trie) ===\n", K_DIMS);
+    double minv[MAX_DIMS], maxv[MAX_DIMS];
+    demo_box(minv, maxv);
+
+    if (argc > 2 && strcmp(argv[1], "--save-snapshot") == 0) {
+        int ok = save_quad_snapshot(argv[2], ids, total_n);
+        store_free(); free(ids); free(results);
+        return ok ? 0 : 1;
+    }
+
+    printf("\n=== Generalized Quadtree (%d-D Trie) ===\n", k_dims);
     printf("--------------------------------------------------------------------------\n");
     printf("| Size         | Build (s) | Insert (s) | Query (s) | Memory (MB) |\n");
     printf("--------------------------------------------------------------------------\n");
 
     int step = 20000; 
     for(int n = step; n <= total_n; n += step) {
-        QuadNode *root = create_node(root_min, root_max);
+        for(int i=0; i<n; i++) ids[i] = i;
         
+        // The last movie is left out of the build and inserted on its own
         clock_t start = clock();
-        for(int i=0; i<n; i++) insert_quad(root, &data[i], 0);
+        QuadNode *root = build_quad(ids, n - 1);
         double build_time = (double)(clock()-start)/CLOCKS_PER_SEC;
 
         start = clock();
-        insert_quad(root, &data[n-1], 0);
+        root = insert_quad_root(root, n - 1);
         double insert_time = (double)(clock()-start)/CLOCKS_PER_SEC;
 
         int count = 0;
@@ -174,47 +541,86 @@ int main() {
         double mem_mb = bytes / (1024.0 * 1024.0);
         
         printf("| %-12d | %-9.4f | %-10.4f | %-9.4f | %-11.2f |\n", n, build_time, insert_time, query_time, mem_mb);
-        free_quad(root);
+        reset_quad_arena();
     }
     printf("--------------------------------------------------------------------------\n");
 
     // DEMO
-    QuadNode *root = create_node(root_min, root_max);
-    for(int i=0; i<total_n; i++) insert_quad(root, &data[i], 0);
+    for(int i=0; i<total_n; i++) ids[i] = i;
+    QuadNode *root = build_quad(ids, total_n);
     
     int count = 0;
     query_quad(root, minv, maxv, results, &count);
     printf("Query Found: %d movies\n", count);
+    // Wide box matching the whole catalog, sequential vs parallel. These
+    // timings get their own buffer; results keeps the demo box for below.
+    int *scratch = malloc((db.count > 0 ? db.count : 1) * sizeof(int));
+    double wmin[MAX_DIMS], wmax[MAX_DIMS];
+    for(int i=0; i<k_dims; i++) { wmin[i] = -INFINITY; wmax[i] = INFINITY; }
+    int c_seq = 0, c_par = 0;
+    query_pool_start();
+    double t0 = wall_time();
+    query_quad(root, wmin, wmax, scratch, &c_seq);
+    double t1 = wall_time();
+    query_quad_par(root, wmin, wmax, scratch, &c_par);
+    double t2 = wall_time();
+    printf("[Parallel Query] Wide box: %d movies in %.4fs on 1 thread, %d movies in %.4fs on %d threads\n",
+           c_seq, t1 - t0, c_par, t2 - t1, qpool.nthreads);
+
+    // A page of boxes answered in one batched traversal vs one query each
+    int nbox = 200;
+    double (*bmin)[MAX_DIMS] = malloc(nbox * sizeof(*bmin)), (*bmax)[MAX_DIMS] = malloc(nbox * sizeof(*bmax));
+    random_boxes(bmin, bmax, nbox, 42);
+    BoxBatch batch;
+    batch_init(&batch, bmin, bmax, nbox);
+    t0 = wall_time();
+    query_quad_batch(root, &batch);
+    t1 = wall_time();
+    int c_single = 0;
+    for(int i=0; i<nbox; i++) {
+        int c = 0;
+        query_quad(root, bmin[i], bmax[i], scratch, &c);
+        c_single += c;
+    }
+    t2 = wall_time();
+    int c_batch = 0;
+    for(int i=0; i<nbox; i++) c_batch += batch.cnt[i];
+    printf("[Batch Query] %d boxes: %d matches in %.4fs batched, %d matches in %.4fs one by one\n",
+           nbox, c_batch, t1 - t0, c_single, t2 - t1);
+    batch_free(&batch);
+    free(bmin); free(bmax); free(scratch);
 
     if (count > 0) {
-        printf("\n[Delete Demo] Removing: '%s'\n", results[0]->title);
-        results[0]->is_deleted = 1;
+        printf("\n[Delete Demo] Removing: '%s'\n", db.info[results[0]].title);
+        delete_quad(&root, results[0]);
+        db.deleted[results[0]] = 1;
         
         printf("[Update Demo] Updating popularity...\n");
-        if (count > 1) update_quad(root, results[1], results[1]->values[1] + 10.0);
+        if (count > 1) update_quad(&root, results[1], db.col[1][results[1]] + 10.0);
 
         int c2 = 0;
+        t0 = wall_time();
         query_quad(root, minv, maxv, results, &c2);
+        t1 = wall_time();
+        Agg agg;
+        agg_quad(root, minv, maxv, &agg);
+        print_agg(&agg, wall_time() - t1, c2, t1 - t0);
         
-        if(c2 > 0) run_knn(results[0], results, c2, 5);
+        if (c2 > 0) {
+            Neighbor nn[5];
+            int found = run_knn(results[0], results, c2, 5, nn);
+            print_neighbors("kNN Search", results[0], nn, found);
+        }
 
         if (c2 > 0) {
-            printf("\n[LSH Similarity - Banding] Target: %s\n", results[0]->title);
-            printf("(Showing candidates that collide in at least 1 band)\n");
-            int found_sim = 0;
-            for(int i=1; i<c2 && i<1000; i++) { 
-                if (check_lsh_bands(results[0], results[i])) {
-                    double sim = jaccard_similarity(results[0], results[i]);
-                    if (sim > 0.3) {
-                        printf(" -> Candidate: %s (Jaccard: %.2f)\n", results[i]->title, sim);
-                        found_sim++;
-                    }
-                }
-            }
-            if (found_sim == 0) printf("No similar text features found in query results.\n");
+            LshIndex lsh;
+            lsh_build(&lsh, db.count);
+            print_lsh_similar(&lsh, results[0], 0.3);
+            lsh_free(&lsh);
         }
     }
-    free_quad(root);
-    free(data); free(results);
+    reset_quad_arena();
+    store_free(); free(ids); free(results);
     return 0;
-}
\ No newline at end of file
+}
+#endif
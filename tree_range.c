@@ -1,124 +1,845 @@
 #include "movies_common.h"
 
+// Layered range tree: the primary tree is ordered on dim 0 and every node keeps
+// its subtree sorted on dim 1. Fractional cascading links each aux entry to the
+// matching positions in the children's aux lists, so after one binary search at
+// the root every secondary search costs O(1). A full d-level tree would need
+// O(n log^(d-1) n) memory, so dims 2.. are filtered while reporting.
+//
+// The tree holds slots, not movies. A movie inserted or moved after the build
+// takes a fresh slot (its old one stays dead), which is appended to a buffer
+// on every node of its dim 0 search path. A canonical node scans its whole
+// buffer, so once a buffer holds more than RANGE_BUFFER_MIN plus
+// RANGE_BUFFER_RATIO of its node's aux list, the highest such subtree is
+// rebuilt with its buffer folded into the aux lists. Above it the slots stay
+// buffered, and since the rebuilt aux list now holds slots its parent's lacks,
+// a search entering it binary searches instead of following the cascade.
+#define RANGE_BUFFER_MIN 8
+#define RANGE_BUFFER_RATIO 0.125
+
 typedef struct RangeNode {
-    Movie *movie; 
+    int id; // Slot
     struct RangeNode *left, *right;
-    Movie **sorted_aux; 
-    int size;
+    int *sorted_aux;            // subtree slots ordered by (dim 1, slot)
+    int *left_pos, *right_pos;  // size+1 entries: cascade into the children's aux
+    double lo, hi;              // dim 0 extent of the subtree
+    int size, dead;             // aux entries, and how many aux and buffer entries are removed
+    int *moved;                 // Buffer of slots placed below this node after its build
+    int nmoved, moved_cap;
+    int uncascaded;             // Aux list is not a subset of the parent's
+    Agg *agg;                   // Subtrees of at least AGG_MIN_SUBTREE nodes, NULL below
+    double *prefix;             // With 2 dims and an agg: size+1 dim 0 sums of the aux list, then size+1 dim 1 sums
 } RangeNode;
 
+Arena range_arena; // Nodes, aggregates, buffers, and the aux and cascade blocks
+// By slot. The first range_base slots are the movie ids of the last root
+// build; each insert takes the next one.
+int *range_id;                // Movie in the slot
+unsigned char *range_removed; // The slot's entries are skipped
+double *range_x, *range_y;    // Dim 0 and 1 values the slot is ordered by
+int range_base, range_nslots, range_slot_cap;
+// By movie id, sized to the store's capacity
+int *range_slot;              // Its live slot, -1 if none
+int range_id_cap;
+
+// Skips the lookup for the slots of the last build
+static inline int range_movie(int s) { return s < range_base ? s : range_id[s]; }
+int range_live(int s) { return !range_removed[s] && !db.deleted[range_movie(s)]; }
+
+// Grows the by-movie slot map to the store's capacity
+void range_reserve() {
+    int cap = db.capacity > 0 ? db.capacity : 1;
+    if (cap <= range_id_cap) return;
+    range_slot = realloc(range_slot, cap * sizeof(int));
+    for(int i=range_id_cap; i<cap; i++) range_slot[i] = -1;
+    range_id_cap = cap;
+}
+
+// Grows the by-slot arrays to hold n slots
+void range_reserve_slots(int n) {
+    if (n <= range_slot_cap) return;
+    int cap = range_slot_cap ? range_slot_cap : 1;
+    while (cap < n) cap *= 2;
+    range_id = realloc(range_id, cap * sizeof(int));
+    range_removed = realloc(range_removed, cap);
+    range_x = realloc(range_x, cap * sizeof(double));
+    range_y = realloc(range_y, cap * sizeof(double));
+    range_slot_cap = cap;
+}
+
 // RAM Calculation: Includes structural nodes + aux arrays
 long get_range_memory(RangeNode *n) {
     if (!n) return 0;
     long size = sizeof(RangeNode);
-    size += n->size * sizeof(Movie*); // Aux array size
+    size += n->size * sizeof(int); // Aux array size
+    size += 2 * (n->size + 1) * sizeof(int); // Cascade pointers
+    size += n->moved_cap * sizeof(int);
+    if (n->agg) size += sizeof(Agg);
+    if (n->prefix) size += 2 * (n->size + 1) * sizeof(double);
     size += get_range_memory(n->left);
     size += get_range_memory(n->right);
     return size;
 }
 
-int check_lsh_bands(Movie *m1, Movie *m2) {
-    int bands = 5, rows = 4;
-    for (int b = 0; b < bands; b++) {
-        int match = 1;
-        for (int r = 0; r < rows; r++) {
-            if (m1->minhash_sig[b * rows + r] != m2->minhash_sig[b * rows + r]) { match = 0; break; }
-        }
-        if (match) return 1;
-    }
-    return 0;
+// Primary order: dim 0, ties broken by slot, so a delete finds its node on one path.
+// The orders use range_x/range_y, which keep a moved movie's old values for
+// its dead slot.
+int cmp_dim0(const void *a, const void *b) { 
+    double v1 = range_x[*(int*)a]; double v2 = range_x[*(int*)b];
+    if (v1 != v2) return (v1 > v2) - (v1 < v2);
+    return (*(int*)a > *(int*)b) - (*(int*)a < *(int*)b);
 }
 
-int cmp_dim0(const void *a, const void *b) { 
-    double v1 = (*(Movie**)a)->values[0]; double v2 = (*(Movie**)b)->values[0];
-    return (v1 > v2) - (v1 < v2);
+// Aux order: dim 1, ties broken by slot
+int before_dim1(int a, int b) {
+    double v1 = range_y[a], v2 = range_y[b];
+    return v1 < v2 || (v1 == v2 && a < b);
+}
+
+// Side of node that slot s belongs to: 0 left, 1 right
+int range_side(RangeNode *node, int s) {
+    double x = range_x[s], nx = range_x[node->id];
+    return x > nx || (x == nx && s > node->id);
+}
+
+// Buffer entry whose search path stops at node (its side has no child)
+int range_move_ends(RangeNode *node, int s) {
+    return !(range_side(node, s) ? node->right : node->left);
 }
-int cmp_dim1(const void *a, const void *b) { 
-    double v1 = (*(Movie**)a)->values[1]; double v2 = (*(Movie**)b)->values[1];
-    return (v1 > v2) - (v1 < v2);
+
+// All aux lists and cascade arrays are carved from two contiguous blocks
+typedef struct {
+    int *aux, *pos;
+} RangePool;
+
+long range_aux_total(int n) {
+    if (n <= 0) return 0;
+    int mid = n / 2;
+    return n + range_aux_total(mid) + range_aux_total(n - mid - 1);
 }
 
-RangeNode* build_range(Movie **mptr, int n) {
+// From the children's aggregates, or from the aux list and buffer when a child has none
+void range_agg_recompute(RangeNode *node) {
+    agg_clear(node->agg);
+    int whole = (node->left && !node->left->agg) || (node->right && !node->right->agg);
+    for(int i=0; i<node->nmoved && (whole || !node->left || !node->right); i++) {
+        int s = node->moved[i];
+        if (!range_removed[s] && (whole || range_move_ends(node, s))) agg_add(node->agg, range_movie(s));
+    }
+    if (whole) {
+        for(int i=0; i<node->size; i++) {
+            int s = node->sorted_aux[i];
+            if (!range_removed[s]) agg_add(node->agg, range_movie(s));
+        }
+        return;
+    }
+    if (!range_removed[node->id]) agg_add(node->agg, range_movie(node->id));
+    if (node->left) agg_merge(node->agg, node->left->agg);
+    if (node->right) agg_merge(node->agg, node->right->agg);
+}
+
+// slots must already be sorted on dim 0. Children are built first, then the
+// node's aux list is produced by merging theirs (plus its own slot), and the
+// cascade positions fall out of the same merge.
+RangeNode* build_range_rec(int *ids, int n, RangePool *pool) {
     if (n <= 0) return NULL;
-    qsort(mptr, n, sizeof(Movie*), cmp_dim0); 
-    
     int mid = n / 2;
-    RangeNode *node = malloc(sizeof(RangeNode));
-    node->movie = mptr[mid];
+    RangeNode *node = arena_alloc(&range_arena, sizeof(RangeNode));
+    node->id = ids[mid];
     node->size = n;
-    
-    node->sorted_aux = malloc(n * sizeof(Movie*));
-    memcpy(node->sorted_aux, mptr, n * sizeof(Movie*));
-    qsort(node->sorted_aux, n, sizeof(Movie*), cmp_dim1);
+    node->dead = 0;
+    node->moved = NULL;
+    node->nmoved = node->moved_cap = 0;
+    node->uncascaded = 0;
+    node->lo = range_x[ids[0]];
+    node->hi = range_x[ids[n - 1]];
+    node->sorted_aux = pool->aux; pool->aux += n;
+    node->left_pos = pool->pos;   pool->pos += n + 1;
+    node->right_pos = pool->pos;  pool->pos += n + 1;
 
-    node->left = build_range(mptr, mid);
-    node->right = build_range(mptr + mid + 1, n - mid - 1);
+    node->left = build_range_rec(ids, mid, pool);
+    node->right = build_range_rec(ids + mid + 1, n - mid - 1, pool);
+
+    int *la = node->left ? node->left->sorted_aux : NULL;
+    int *ra = node->right ? node->right->sorted_aux : NULL;
+    int ln = mid, rn = n - mid - 1;
+    int l = 0, r = 0, self = 0;
+    for (int i = 0; i < n; i++) {
+        node->left_pos[i] = l;
+        node->right_pos[i] = r;
+        int best = -1, from = 0;
+        if (l < ln) { best = la[l]; from = 0; }
+        if (r < rn && (best < 0 || before_dim1(ra[r], best))) { best = ra[r]; from = 1; }
+        if (!self && (best < 0 || before_dim1(node->id, best))) { best = node->id; from = 2; }
+        node->sorted_aux[i] = best;
+        if (from == 0) l++;
+        else if (from == 1) r++;
+        else self = 1;
+    }
+    node->left_pos[n] = l;
+    node->right_pos[n] = r;
+    node->agg = NULL;
+    node->prefix = NULL;
+    if (n >= AGG_MIN_SUBTREE) {
+        node->agg = arena_alloc(&range_arena, sizeof(Agg));
+        range_agg_recompute(node);
+    }
+    if (n >= AGG_MIN_SUBTREE && k_dims == 2) {
+        double *px = node->prefix = arena_alloc(&range_arena, 2 * (n + 1) * sizeof(double)), *py = px + n + 1;
+        px[0] = py[0] = 0.0;
+        for(int i=0; i<n; i++) {
+            px[i + 1] = px[i] + range_x[node->sorted_aux[i]];
+            py[i + 1] = py[i] + range_y[node->sorted_aux[i]];
+        }
+    }
     return node;
 }
 
-void free_range(RangeNode *node) {
+// Fresh slot table: each movie in ids takes the slot equal to its id
+RangeNode* build_range(int *ids, int n) {
+    range_reserve();
+    range_base = range_nslots = range_id_cap;
+    range_reserve_slots(range_nslots);
+    memset(range_removed, 1, range_nslots);
+    memset(range_slot, -1, range_id_cap * sizeof(int));
+    for(int i=0; i<n; i++) {
+        int id = ids[i];
+        range_slot[id] = id;
+        range_removed[id] = 0;
+        range_x[id] = db.col[0][id];
+        range_y[id] = db.col[1][id];
+    }
+    if (n <= 0) return NULL;
+    qsort(ids, n, sizeof(int), cmp_dim0); // Once, not per level
+    long total = range_aux_total(n);
+    RangePool pool;
+    pool.aux = arena_alloc(&range_arena, total * sizeof(int));
+    pool.pos = arena_alloc(&range_arena, 2 * (total + n) * sizeof(int));
+    return build_range_rec(ids, n, &pool);
+}
+
+// O(1) in the node count: frees every node, aux block and slot table, so
+// the tree in use is gone and the next build starts fresh
+void reset_range_arena(void) {
+    arena_free(&range_arena);
+    free(range_id); free(range_removed); free(range_x); free(range_y); free(range_slot);
+    range_id = range_slot = NULL; range_removed = NULL; range_x = range_y = NULL;
+    range_base = range_nslots = range_slot_cap = range_id_cap = 0;
+}
+
+// --- Deletes and inserts ---
+// A deleted movie's slot is flagged in range_removed and every node on its
+// path counts one more removed entry. Once removed entries pass
+// TOMBSTONE_RATIO of a node's aux list and buffer, or its buffer passes the
+// bound above, the highest such subtree is rebuilt from its live slots, the
+// buffered ones included. The rebuild reuses the subtree's aux and cascade
+// blocks when it fits in them, and the parent's cascade into it is redone with
+// one merge unless it absorbed buffered slots. Rebuilding the root starts a
+// fresh arena and slot table instead.
+void range_release(RangeNode *node) {
     if (!node) return;
-    free_range(node->left);
-    free_range(node->right);
-    if (node->sorted_aux) free(node->sorted_aux);
-    free(node);
+    range_release(node->left);
+    range_release(node->right);
+    if (node->agg) arena_release(&range_arena, node->agg, sizeof(Agg));
+    if (node->prefix) arena_release(&range_arena, node->prefix, 2 * (node->size + 1) * sizeof(double));
+    if (node->moved) arena_release(&range_arena, node->moved, node->moved_cap * sizeof(int));
+    arena_release(&range_arena, node, sizeof(RangeNode));
+}
+
+// Live slots of the aux list and then of the buffer (the two never share a
+// slot), sorted on dim 0; *from_buffer counts the buffer's
+int range_live_slots(RangeNode *node, int *out, int *from_buffer) {
+    int n = 0;
+    for(int i=0; i<node->size; i++) {
+        if (range_live(node->sorted_aux[i])) out[n++] = node->sorted_aux[i];
+    }
+    int static_n = n;
+    for(int i=0; i<node->nmoved; i++) {
+        if (range_live(node->moved[i])) out[n++] = node->moved[i];
+    }
+    *from_buffer = n - static_n;
+    qsort(out, n, sizeof(int), cmp_dim0);
+    return n;
 }
 
-void update_range(RangeNode **root, Movie *target, double new_pop) {
-    printf(" [Update] Moved '%s' (Pop: %.2f -> %.2f)\n", target->title, target->values[1], new_pop);
-    target->values[1] = new_pop;
+void range_rebuild_child(RangeNode *parent, int side) {
+    RangeNode **link = side ? &parent->right : &parent->left;
+    RangeNode *old = *link;
+    int *slots = malloc((old->size + old->nmoved) * sizeof(int));
+    int absorbed, n = range_live_slots(old, slots, &absorbed);
+    int uncascaded = old->uncascaded || absorbed > 0;
+    RangePool pool = { old->sorted_aux, old->left_pos };
+    if (n > old->size) {
+        long total = range_aux_total(n);
+        pool.aux = arena_alloc(&range_arena, total * sizeof(int));
+        pool.pos = arena_alloc(&range_arena, 2 * (total + n) * sizeof(int));
+    }
+    range_release(old);
+    *link = build_range_rec(slots, n, &pool);
+    free(slots);
+    if (!*link) return; // Its buffered slots now stop at the parent
+    (*link)->uncascaded = uncascaded;
+    if (uncascaded) return;
+
+    int *aux = (*link)->sorted_aux;
+    int *pos = side ? parent->right_pos : parent->left_pos;
+    int j = 0;
+    for(int i=0; i<parent->size; i++) {
+        while (j < n && before_dim1(aux[j], parent->sorted_aux[i])) j++;
+        pos[i] = j;
+    }
+    pos[parent->size] = n;
+}
+
+RangeNode* range_rebuild_root(RangeNode *root) {
+    int *ids = malloc((root->size + root->nmoved) * sizeof(int));
+    int absorbed, n = range_live_slots(root, ids, &absorbed);
+    for(int i=0; i<n; i++) ids[i] = range_movie(ids[i]);
+    reset_range_arena();
+    root = build_range(ids, n);
+    free(ids);
+    return root;
+}
+
+// Counts slot s removed on every node of its path, which ends at the node
+// holding s or, for a buffered slot, where its side has no child
+void range_delete_rec(RangeNode *node, int s, int *wants) {
+    int side = 0, child_wants = 0;
+    if (node->id != s) {
+        side = range_side(node, s);
+        RangeNode *child = side ? node->right : node->left;
+        if (child) range_delete_rec(child, s, &child_wants);
+    }
+    node->dead++;
+    *wants = node->dead > TOMBSTONE_RATIO * (node->size + node->nmoved);
+    if (!*wants && child_wants) range_rebuild_child(node, side);
+    if (node->agg) range_agg_recompute(node);
+}
+
+// Removes a movie; call it while the movie still has the coordinates it was
+// indexed with. Returns 0 when it is not in the tree.
+int delete_range(RangeNode **root, int id) {
+    if (!*root || id >= range_id_cap || range_slot[id] < 0) return 0;
+    int s = range_slot[id], wants;
+    range_slot[id] = -1;
+    range_removed[s] = 1;
+    range_delete_rec(*root, s, &wants);
+    if (wants) *root = range_rebuild_root(*root);
+    return 1;
+}
+
+// Appends slot s to the buffers on its path below node, widening their dim 0 extents
+void range_place(RangeNode *node, int s, int *wants) {
+    if (node->nmoved == node->moved_cap) {
+        int cap = node->moved_cap ? 2 * node->moved_cap : 4;
+        node->moved = arena_realloc(&range_arena, node->moved, node->moved_cap * sizeof(int), cap * sizeof(int));
+        node->moved_cap = cap;
+    }
+    node->moved[node->nmoved++] = s;
+    if (range_x[s] < node->lo) node->lo = range_x[s];
+    if (range_x[s] > node->hi) node->hi = range_x[s];
+    int side = range_side(node, s), child_wants = 0;
+    RangeNode *child = side ? node->right : node->left;
+    if (child) range_place(child, s, &child_wants);
+    *wants = node->nmoved > RANGE_BUFFER_MIN + RANGE_BUFFER_RATIO * node->size;
+    if (!*wants && child_wants) range_rebuild_child(node, side);
+    if (node->agg) range_agg_recompute(node);
+}
+
+// Adds a movie that is not in the tree at its current coordinates: O(log n)
+// buffer appends, plus the rebuild of a subtree whose buffer is over its bound
+// (O(log^2 n) amortized).
+void insert_range(RangeNode **root, int id) {
+    if (!*root) {
+        *root = build_range(&id, 1);
+        return;
+    }
+    range_reserve();
+    int s = range_nslots++, wants;
+    range_reserve_slots(range_nslots);
+    range_id[s] = id;
+    range_removed[s] = 0;
+    range_x[s] = db.col[0][id];
+    range_y[s] = db.col[1][id];
+    range_slot[id] = s;
+    range_place(*root, s, &wants);
+    if (wants) *root = range_rebuild_root(*root);
+}
+
+void update_range(RangeNode **root, int target, double new_pop) {
+    printf(" [Update] Moved '%s' (Pop: %.2f -> %.2f)\n", db.info[target].title, db.col[1][target], new_pop);
+    delete_range(root, target);
+    store_set(target, 1, new_pop);
+    insert_range(root, target);
+}
+
+// First position in a dim 1 ordered aux list whose value (key[slot]) is >= y
+int lower_bound_dim1(const int *aux, int n, const double *key, double y) {
+    int lo = 0, hi = n;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (key[aux[mid]] < y) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
 }
 
-void query_range(RangeNode *node, double min[], double max[], Movie **res, int *cnt) {
+// First position whose value is > y
+int upper_bound_dim1(const int *aux, int n, const double *key, double y) {
+    int lo = 0, hi = n;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (key[aux[mid]] <= y) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+// pos as carried down by cascading, or searched for when the node's aux list
+// holds slots its parent's does not
+static inline int range_start(RangeNode *node, int pos, double y) {
+    return node->uncascaded ? lower_bound_dim1(node->sorted_aux, node->size, range_y, y) : pos;
+}
+
+static inline int range_end(RangeNode *node, int pos, double y) {
+    return node->uncascaded ? upper_bound_dim1(node->sorted_aux, node->size, range_y, y) : pos;
+}
+
+// Canonical subtree: dim 0 is covered, dim 1 is a contiguous run of the aux list
+KERNEL void report_aux_k(const int D, RangeNode *node, int pos, double min[], double max[], int *res, int *cnt) {
+    const int *aux = node->sorted_aux, n = node->size, base = range_base;
+    for (int i = pos; i < n; i++) {
+        int s = aux[i];
+        if (range_y[s] > max[1]) break;
+        if (range_removed[s]) continue;
+        int id = s < base ? s : range_id[s];
+        if (!db.deleted[id] && point_in_box_k(D, id, min, max, 2)) res[(*cnt)++] = id;
+    }
+}
+
+void report_aux(RangeNode *node, int pos, double min[], double max[], int *res, int *cnt) {
+    DIMS_SWITCH(report_aux_k(D, node, pos, min, max, res, cnt));
+}
+
+// Buffered slots in the box; ends: only those whose path stops at node
+void report_moved(RangeNode *node, int ends, double min[], double max[], int *res, int *cnt) {
+    for (int i = 0; i < node->nmoved; i++) {
+        int s = node->moved[i];
+        if (range_live(s) && point_in_box(range_movie(s), min, max) && (!ends || range_move_ends(node, s))) res[(*cnt)++] = range_movie(s);
+    }
+}
+
+// pos: first entry of node's aux with dim 1 >= min[1], carried down by cascading
+void range_search(RangeNode *node, int pos, double min[], double max[], int *res, int *cnt) {
     if (!node) return;
-    
-    if (node->movie->values[0] >= min[0] && node->movie->values[0] <= max[0]) {
-        Movie *m = node->movie;
-        if (!m->is_deleted) {
-            int match = 1;
-            for(int k=0; k<K_DIMS; k++) {
-                if (m->values[k] < min[k] || m->values[k] > max[k]) { match=0; break; }
+    pos = range_start(node, pos, min[1]);
+    if (pos >= node->size && !node->nmoved) return;
+    if (node->hi < min[0] || node->lo > max[0]) return;
+    if (node->lo >= min[0] && node->hi <= max[0]) {
+        report_aux(node, pos, min, max, res, cnt);
+        report_moved(node, 0, min, max, res, cnt);
+        return;
+    }
+    int s = node->id;
+    if (range_live(s) && point_in_box(range_movie(s), min, max)) res[(*cnt)++] = range_movie(s);
+    if (node->nmoved && (!node->left || !node->right)) report_moved(node, 1, min, max, res, cnt);
+    range_search(node->left, node->left_pos[pos], min, max, res, cnt);
+    range_search(node->right, node->right_pos[pos], min, max, res, cnt);
+}
+
+void query_range(RangeNode *node, double min[], double max[], int *res, int *cnt) {
+    if (!node) return;
+    range_search(node, lower_bound_dim1(node->sorted_aux, node->size, range_y, min[1]), min, max, res, cnt);
+}
+
+// --- Aggregates ---
+// With 2 dims a subtree covered on dim 0 answers its dim 1 run [lo, hi) from
+// the prefix sums: the count is hi - lo, the dim 1 extremes are the run's
+// ends, and the dim 0 extremes come from one walk down the tree, since the
+// leftmost child with a nonempty run holds the smallest dim 0 value. Both
+// run ends are carried by cascading, so the cost follows the box boundary.
+// A subtree with removed entries has stale sums and is scanned instead.
+
+// Dim 0 extreme of the aux run [lo, hi) of a subtree without removed
+// entries: want_max walks right-first, otherwise left-first
+double range_run_x(RangeNode *node, int lo, int hi, double y0, double y1, int want_max) {
+    while (node) {
+        lo = range_start(node, lo, y0);
+        hi = range_end(node, hi, y1);
+        RangeNode *first = want_max ? node->right : node->left;
+        RangeNode *second = want_max ? node->left : node->right;
+        int *first_pos = want_max ? node->right_pos : node->left_pos;
+        int *second_pos = want_max ? node->left_pos : node->right_pos;
+        if (first && range_end(first, first_pos[hi], y1) > range_start(first, first_pos[lo], y0)) {
+            int l = first_pos[lo], h = first_pos[hi];
+            node = first; lo = l; hi = h;
+        } else if (range_y[node->id] >= y0 && range_y[node->id] <= y1) {
+            return range_x[node->id];
+        } else {
+            int l = second_pos[lo], h = second_pos[hi];
+            node = second; lo = l; hi = h;
+        }
+    }
+    return want_max ? -INFINITY : INFINITY;
+}
+
+// Folds the live entries of an aux run that lie in the box on dims 2..
+KERNEL void agg_aux_k(const int D, RangeNode *node, int lo, int hi, double min[], double max[], Agg *out) {
+    const int *aux = node->sorted_aux, base = range_base;
+    Agg a;
+    agg_clear(&a);
+    for (int i = lo; i < hi; i++) {
+        int s = aux[i];
+        if (range_removed[s]) continue;
+        int id = s < base ? s : range_id[s];
+        if (db.deleted[id] || !point_in_box_k(D, id, min, max, 2)) continue;
+        double c[MAX_DIMS];
+        for (int d = 0; d < D; d++) c[d] = db.col[d][id];
+        agg_add_point_k(D, &a, c);
+    }
+    agg_merge_k(D, out, &a);
+}
+
+// Aux run [lo, hi) of a subtree covered on dim 0, its buffer left to the caller.
+// A subtree with removed entries is split into its own slot and its children,
+// so only the removed entries' paths are opened; below an uncascaded child the
+// children's lists would repeat buffered slots, so the run is scanned instead.
+void agg_range_run(RangeNode *node, int lo, int hi, double min[], double max[], Agg *out) {
+    if (!node) return;
+    lo = range_start(node, lo, min[1]);
+    hi = range_end(node, hi, max[1]);
+    if (lo >= hi) return;
+    if (node->prefix && !node->dead && hi - lo > AGG_MIN_SUBTREE) { // Shorter runs are cheaper to scan than to walk
+        const double *px = node->prefix, *py = px + node->size + 1;
+        Agg run;
+        agg_clear(&run);
+        run.count = hi - lo;
+        run.sum[0] = px[hi] - px[lo];
+        run.sum[1] = py[hi] - py[lo];
+        run.min[1] = range_y[node->sorted_aux[lo]];
+        run.max[1] = range_y[node->sorted_aux[hi - 1]];
+        run.min[0] = range_run_x(node, lo, hi, min[1], max[1], 0);
+        run.max[0] = range_run_x(node, lo, hi, min[1], max[1], 1);
+        agg_merge(out, &run);
+        return;
+    }
+    int split = node->prefix && node->dead && hi - lo > AGG_MIN_SUBTREE && !(node->left && node->left->uncascaded) && !(node->right && node->right->uncascaded);
+    if (split) {
+        int s = node->id;
+        if (!range_removed[s] && range_y[s] >= min[1] && range_y[s] <= max[1]) agg_add(out, range_movie(s));
+        agg_range_run(node->left, node->left_pos[lo], node->left_pos[hi], min, max, out);
+        agg_range_run(node->right, node->right_pos[lo], node->right_pos[hi], min, max, out);
+        return;
+    }
+    DIMS_SWITCH(agg_aux_k(D, node, lo, hi, min, max, out));
+}
+
+// lo/hi: first entry of node's aux with dim 1 >= min[1] and > max[1]
+void agg_range_search(RangeNode *node, int lo, int hi, double min[], double max[], Agg *out) {
+    if (!node) return;
+    lo = range_start(node, lo, min[1]);
+    hi = range_end(node, hi, max[1]);
+    if (lo >= hi && !node->nmoved) return;
+    if (node->hi < min[0] || node->lo > max[0]) return;
+    if (node->agg) {
+        if (agg_disjoint(node->agg, min, max)) return;
+        if (agg_inside(node->agg, min, max)) { agg_merge(out, node->agg); return; }
+    }
+    int whole = node->lo >= min[0] && node->hi <= max[0];
+    for (int i = 0; i < node->nmoved && (whole || !node->left || !node->right); i++) {
+        int s = node->moved[i];
+        if (!range_removed[s] && point_in_box(range_movie(s), min, max) && (whole || range_move_ends(node, s))) agg_add(out, range_movie(s));
+    }
+    if (whole) {
+        agg_range_run(node, lo, hi, min, max, out);
+        return;
+    }
+    int s = node->id;
+    if (!range_removed[s] && point_in_box(range_movie(s), min, max)) agg_add(out, range_movie(s));
+    agg_range_search(node->left, node->left_pos[lo], node->left_pos[hi], min, max, out);
+    agg_range_search(node->right, node->right_pos[lo], node->right_pos[hi], min, max, out);
+}
+
+// Count/sum/min/max over the box. Beyond 2 dims the primary tree covers
+// dim 0 only and no prefix sums are kept, so covered runs are folded entry
+// by entry, filtered on dims 2.., in the same pass that would list them.
+void agg_range(RangeNode *root, double min[], double max[], Agg *out) {
+    agg_clear(out);
+    if (root) agg_range_search(root, lower_bound_dim1(root->sorted_aux, root->size, range_y, min[1]),
+                               upper_bound_dim1(root->sorted_aux, root->size, range_y, max[1]), min, max, out);
+}
+
+// --- Parallel query: tasks are (subtree, cascade position) pairs ---
+void range_query_task(QueryTask *t, double min[], double max[], int *res, int *cnt) {
+    range_search(t->node, t->arg, min, max, res, cnt);
+}
+
+int range_query_expand(QueryTask *t, double min[], double max[], QueryTaskList *out, int *res, int *cnt) {
+    RangeNode *node = t->node;
+    int pos = range_start(node, t->arg, min[1]);
+    if ((pos >= node->size && !node->nmoved) || node->hi < min[0] || node->lo > max[0]) return 1;
+    if ((node->lo >= min[0] && node->hi <= max[0]) || (!node->left && !node->right)) return 0;
+    int s = node->id;
+    if (range_live(s) && point_in_box(range_movie(s), min, max)) res[(*cnt)++] = range_movie(s);
+    if (node->nmoved && (!node->left || !node->right)) report_moved(node, 1, min, max, res, cnt);
+    if (node->left) task_push(out, node->left, node->left_pos[pos]);
+    if (node->right) task_push(out, node->right, node->right_pos[pos]);
+    return 1;
+}
+
+void query_range_par(RangeNode *root, double min[], double max[], int *res, int *cnt) {
+    if (!root) return;
+    QueryTask t = { root, lower_bound_dim1(root->sorted_aux, root->size, range_y, min[1]) };
+    query_parallel(t, range_query_expand, range_query_task, min, max, res, cnt);
+}
+
+// --- Batched query: one traversal for a set of boxes ---
+// The active list holds (box, cascade position) pairs
+void batch_report_aux(RangeNode *node, int pos, BoxBatch *b, int box) {
+    double *min = b->min[box], *max = b->max[box];
+    for (int i = pos; i < node->size; i++) {
+        int s = node->sorted_aux[i];
+        if (range_y[s] > max[1]) break;
+        if (range_live(s) && point_in_box_from(range_movie(s), min, max, 2)) batch_report(b, box, range_movie(s));
+    }
+}
+
+void batch_report_moved(RangeNode *node, int ends, BoxBatch *b, int box) {
+    for (int i = 0; i < node->nmoved; i++) {
+        int s = node->moved[i];
+        if (range_live(s) && point_in_box(range_movie(s), b->min[box], b->max[box]) && (!ends || range_move_ends(node, s))) {
+            batch_report(b, box, range_movie(s));
+        }
+    }
+}
+
+void batch_range(RangeNode *node, BoxBatch *b, int act, int nact) {
+    int off = batch_reserve(b, 2 * nact), m = 0;
+    for(int i=0; i<nact; i++) {
+        int box = b->stack[act + 2 * i];
+        double *min = b->min[box], *max = b->max[box];
+        int pos = range_start(node, b->stack[act + 2 * i + 1], min[1]);
+        if ((pos >= node->size && !node->nmoved) || node->hi < min[0] || node->lo > max[0]) continue;
+        if (node->lo >= min[0] && node->hi <= max[0]) {
+            batch_report_aux(node, pos, b, box);
+            batch_report_moved(node, 0, b, box);
+            continue;
+        }
+        int s = node->id;
+        if (range_live(s) && point_in_box(range_movie(s), min, max)) batch_report(b, box, range_movie(s));
+        if (node->nmoved && (!node->left || !node->right)) batch_report_moved(node, 1, b, box);
+        b->stack[off + 2 * m] = box;
+        b->stack[off + 2 * m + 1] = pos;
+        m++;
+    }
+    for(int side=0; side<2 && m > 0; side++) {
+        RangeNode *child = side ? node->right : node->left;
+        if (!child) continue;
+        int coff = batch_reserve(b, 2 * m);
+        for(int i=0; i<m; i++) {
+            int pos = b->stack[off + 2 * i + 1];
+            b->stack[coff + 2 * i] = b->stack[off + 2 * i];
+            b->stack[coff + 2 * i + 1] = side ? node->right_pos[pos] : node->left_pos[pos];
+        }
+        batch_range(child, b, coff, m);
+        b->top = coff;
+    }
+    b->top = off;
+}
+
+void query_range_batch(RangeNode *root, BoxBatch *b) {
+    if (!root) return;
+    int act = batch_reserve(b, 2 * b->nboxes);
+    for(int i=0; i<b->nboxes; i++) {
+        b->stack[act + 2 * i] = i;
+        b->stack[act + 2 * i + 1] = lower_bound_dim1(root->sorted_aux, root->size, range_y, b->min[i][1]);
+    }
+    batch_range(root, b, act, b->nboxes);
+    b->top = act;
+}
+
+// --- Snapshot image: nodes in preorder, children by position ---
+// Aux lists and cascade arrays are packed into two pools; a node's left_pos
+// starts at its pos offset and its right_pos follows size+1 entries later.
+typedef struct {
+    int id, left, right, size; // left/right are -1 when absent
+    double lo, hi;
+    long long aux, pos;
+} RangeImageNode;
+
+typedef struct {
+    const RangeImageNode *nodes;
+    const int *aux, *pos;
+} RangeImage;
+
+void range_image_size(RangeNode *n, int *nodes, long long *aux) {
+    if (!n) return;
+    (*nodes)++;
+    *aux += n->size;
+    range_image_size(n->left, nodes, aux);
+    range_image_size(n->right, nodes, aux);
+}
+
+int encode_range(RangeNode *node, RangeImageNode *out, int *n, int *aux, long long *naux, int *pos, long long *npos) {
+    if (!node) return -1;
+    int i = (*n)++;
+    RangeImageNode *img = &out[i];
+    img->id = node->id; img->size = node->size;
+    img->lo = node->lo; img->hi = node->hi;
+    img->aux = *naux;
+    img->pos = *npos;
+    memcpy(aux + *naux, node->sorted_aux, node->size * sizeof(int));
+    memcpy(pos + *npos, node->left_pos, (node->size + 1) * sizeof(int));
+    memcpy(pos + *npos + node->size + 1, node->right_pos, (node->size + 1) * sizeof(int));
+    *naux += node->size;
+    *npos += 2 * (node->size + 1);
+    img->left = encode_range(node->left, out, n, aux, naux, pos, npos);
+    img->right = encode_range(node->right, out, n, aux, naux, pos, npos);
+    return i;
+}
+
+// Children come after their parent in preorder (so walks end), every aux and
+// cascade run lies inside its pool, aux entries name stored movies and each
+// cascade entry is a position within the child's aux list
+int range_image_valid(const RangeImage *img, long long nnodes, long long naux, long long npos) {
+    for(long long i=0; i<nnodes; i++) {
+        const RangeImageNode *node = &img->nodes[i];
+        if (node->id < 0 || node->id >= db.count || node->size < 0) return 0;
+        if (node->aux < 0 || node->aux + node->size > naux) return 0;
+        if (node->pos < 0 || node->pos + 2 * (node->size + 1LL) > npos) return 0;
+        if (node->left != -1 && (node->left <= i || node->left >= nnodes)) return 0;
+        if (node->right != -1 && (node->right <= i || node->right >= nnodes)) return 0;
+        for(int j=0; j<node->size; j++) {
+            int id = img->aux[node->aux + j];
+            if (id < 0 || id >= db.count) return 0;
+        }
+        for(int side=0; side<2; side++) {
+            int child = side ? node->right : node->left;
+            int limit = child < 0 ? node->size : img->nodes[child].size;
+            const int *cascade = img->pos + node->pos + side * (node->size + 1LL);
+            for(int j=0; j<=node->size; j++) {
+                if (cascade[j] < 0 || cascade[j] > limit) return 0;
             }
-            if (match) res[(*cnt)++] = m;
         }
-        query_range(node->left, min, max, res, cnt);
-        query_range(node->right, min, max, res, cnt);
-    } 
-    else if (node->movie->values[0] > max[0]) {
-        query_range(node->left, min, max, res, cnt);
-    } 
-    else { 
-        query_range(node->right, min, max, res, cnt);
-    }
-}
-
-int main() {
-    Movie *data = malloc(MAX_MOVIES * sizeof(Movie));
-    int total_n = load_csv("movies.csv", data);
-    Movie **ptrs = malloc(total_n * sizeof(Movie*));
-    Movie **results = malloc(total_n * sizeof(Movie*));
+    }
+    return 1;
+}
+
+void range_search_image(const RangeImage *img, int i, int pos, double min[], double max[], int *res, int *cnt) {
+    if (i < 0) return;
+    const RangeImageNode *node = &img->nodes[i];
+    if (pos >= node->size || node->hi < min[0] || node->lo > max[0]) return;
+    const int *aux = img->aux + node->aux;
+    if (node->lo >= min[0] && node->hi <= max[0]) {
+        for (int j = pos; j < node->size; j++) {
+            int id = aux[j];
+            if (db.col[1][id] > max[1]) break;
+            if (!db.deleted[id] && point_in_box(id, min, max)) res[(*cnt)++] = id;
+        }
+        return;
+    }
+    if (!db.deleted[node->id] && point_in_box(node->id, min, max)) res[(*cnt)++] = node->id;
+    const int *left_pos = img->pos + node->pos, *right_pos = left_pos + node->size + 1;
+    range_search_image(img, node->left, left_pos[pos], min, max, res, cnt);
+    range_search_image(img, node->right, right_pos[pos], min, max, res, cnt);
+}
+
+void query_range_image(const RangeImage *img, double min[], double max[], int *res, int *cnt) {
+    const RangeImageNode *root = &img->nodes[0];
+    int pos = lower_bound_dim1(img->aux + root->aux, root->size, db.col[1], min[1]);
+    range_search_image(img, 0, pos, min, max, res, cnt);
+}
+
+int save_range_snapshot(const char *path, int *ids, int n) {
+    for(int i=0; i<n; i++) ids[i] = i;
+    RangeNode *root = build_range(ids, n); // Fresh, so its slots are the movie ids
+    int nnodes = 0, nn = 0;
+    long long total = 0, naux = 0, npos = 0;
+    range_image_size(root, &nnodes, &total);
+    RangeImageNode *nodes = malloc((nnodes > 0 ? nnodes : 1) * sizeof(RangeImageNode));
+    int *aux = malloc((total > 0 ? total : 1) * sizeof(int));
+    int *pos = malloc((2 * (total + nnodes) > 0 ? 2 * (total + nnodes) : 1) * sizeof(int));
+    encode_range(root, nodes, &nn, aux, &naux, pos, &npos);
+
+    SnapWriter w;
+    int ok = snap_create(&w, path);
+    if (ok) {
+        snap_write(&w, "range.nodes", nodes, nnodes * sizeof(RangeImageNode));
+        snap_write(&w, "range.aux", aux, naux * sizeof(int));
+        snap_write(&w, "range.pos", pos, npos * sizeof(int));
+        ok = snap_finish(&w);
+        if (ok) printf("[Snapshot] Wrote %s\n", path);
+    }
+    free(nodes); free(aux); free(pos);
+    reset_range_arena();
+    return ok;
+}
+
+int run_range_snapshot(const char *path) {
+    double t0 = wall_time();
+    Snapshot s;
+    if (!snap_open(&s, path)) return 1;
+    long long size, naux, npos;
+    RangeImage img;
+    img.nodes = snap_find(&s, "range.nodes", &size);
+    img.aux = snap_find(&s, "range.aux", &naux);
+    img.pos = snap_find(&s, "range.pos", &npos);
+    if (!img.nodes || !img.aux || !img.pos) {
+        printf("ERROR: %s holds no range tree.\n", path);
+        snap_close(&s);
+        return 1;
+    }
+    if (!range_image_valid(&img, size / (long long)sizeof(RangeImageNode), naux / (long long)sizeof(int), npos / (long long)sizeof(int))) {
+        printf("ERROR: %s: corrupt range tree sections.\n", path);
+        snap_close(&s);
+        return 1;
+    }
+    double t1 = wall_time();
+
+    double minv[MAX_DIMS], maxv[MAX_DIMS];
+    demo_box(minv, maxv);
+    int *results = malloc((db.count > 0 ? db.count : 1) * sizeof(int));
+    int count = 0;
+    if (size >= (long long)sizeof(RangeImageNode)) query_range_image(&img, minv, maxv, results, &count);
+    print_snapshot_demo(path, t1 - t0, wall_time() - t1, results, count);
+    free(results);
+    snap_close(&s);
+    return 0;
+}
+
+#ifndef TREE_NO_MAIN
+int main(int argc, char **argv) {
+    if (argc > 2 && strcmp(argv[1], "--snapshot") == 0) return run_range_snapshot(argv[2]);
+    int total_n = load_csv("movies.csv");
+    int *ids = malloc(total_n * sizeof(int));
+    int *results = malloc(total_n * sizeof(int));
     
-    // ΔΙΟΡΘΩΣΗ ΓΙΑ 2D
-    double minv[K_DIMS], maxv[K_DIMS];
-    minv[0] = 1000; maxv[0] = 50000; 
-    if (K_DIMS > 1) { minv[1] = 2;    maxv[1] = 50; }
-    if (K_DIMS > 2) { minv[2] = 60;   maxv[2] = 180; }
-    for(int i=3; i<K_DIMS; i++) { minv[i] = -1e9; maxv[i] = 1e9; }
-
-    printf("\n=== Range Tree (%d Dims) ===\n", K_DIMS);
+    double minv[MAX_DIMS], maxv[MAX_DIMS];
+    demo_box(minv, maxv);
+
+    if (argc > 2 && strcmp(argv[1], "--save-snapshot") == 0) {
+        int ok = save_range_snapshot(argv[2], ids, total_n);
+        store_free(); free(ids); free(results);
+        return ok ? 0 : 1;
+    }
+
+    printf("\n=== Range Tree (%d Dims) ===\n", k_dims);
     printf("--------------------------------------------------------------------------\n");
     printf("| Size         | Build (s) | Insert (s) | Query (s) | Memory (MB) |\n");
     printf("--------------------------------------------------------------------------\n");
 
     int step = 20000;
     for(int n = step; n <= total_n; n += step) {
-        for(int i=0; i<n; i++) ptrs[i] = &data[i];
+        for(int i=0; i<n; i++) ids[i] = i;
 
+        // The last movie is left out of the build and inserted on its own
         clock_t start = clock();
-        RangeNode *root = build_range(ptrs, n);
+        RangeNode *root = build_range(ids, n - 1);
         double build_time = (double)(clock()-start)/CLOCKS_PER_SEC;
 
-        double insert_time = 0.0000; 
+        start = clock();
+        insert_range(&root, n - 1);
+        double insert_time = (double)(clock()-start)/CLOCKS_PER_SEC;
 
         int count = 0;
         start = clock();
@@ -129,47 +850,86 @@ int main() {
         double mem_mb = bytes / (1024.0 * 1024.0);
         
         printf("| %-12d | %-9.4f | %-10.4f | %-9.4f | %-11.2f |\n", n, build_time, insert_time, query_time, mem_mb);
-        free_range(root);
+        reset_range_arena();
     }
     printf("--------------------------------------------------------------------------\n");
 
     // DEMO FULL
-    for(int i=0; i<total_n; i++) ptrs[i] = &data[i];
-    RangeNode *root = build_range(ptrs, total_n);
+    for(int i=0; i<total_n; i++) ids[i] = i;
+    RangeNode *root = build_range(ids, total_n);
     int count = 0;
     query_range(root, minv, maxv, results, &count);
     printf("Query Found: %d movies\n", count);
+    // Wide box matching the whole catalog, sequential vs parallel. These
+    // timings get their own buffer; results keeps the demo box for below.
+    int *scratch = malloc((db.count > 0 ? db.count : 1) * sizeof(int));
+    double wmin[MAX_DIMS], wmax[MAX_DIMS];
+    for(int i=0; i<k_dims; i++) { wmin[i] = -INFINITY; wmax[i] = INFINITY; }
+    int c_seq = 0, c_par = 0;
+    query_pool_start();
+    double t0 = wall_time();
+    query_range(root, wmin, wmax, scratch, &c_seq);
+    double t1 = wall_time();
+    query_range_par(root, wmin, wmax, scratch, &c_par);
+    double t2 = wall_time();
+    printf("[Parallel Query] Wide box: %d movies in %.4fs on 1 thread, %d movies in %.4fs on %d threads\n",
+           c_seq, t1 - t0, c_par, t2 - t1, qpool.nthreads);
+
+    // A page of boxes answered in one batched traversal vs one query each
+    int nbox = 200;
+    double (*bmin)[MAX_DIMS] = malloc(nbox * sizeof(*bmin)), (*bmax)[MAX_DIMS] = malloc(nbox * sizeof(*bmax));
+    random_boxes(bmin, bmax, nbox, 42);
+    BoxBatch batch;
+    batch_init(&batch, bmin, bmax, nbox);
+    t0 = wall_time();
+    query_range_batch(root, &batch);
+    t1 = wall_time();
+    int c_single = 0;
+    for(int i=0; i<nbox; i++) {
+        int c = 0;
+        query_range(root, bmin[i], bmax[i], scratch, &c);
+        c_single += c;
+    }
+    t2 = wall_time();
+    int c_batch = 0;
+    for(int i=0; i<nbox; i++) c_batch += batch.cnt[i];
+    printf("[Batch Query] %d boxes: %d matches in %.4fs batched, %d matches in %.4fs one by one\n",
+           nbox, c_batch, t1 - t0, c_single, t2 - t1);
+    batch_free(&batch);
+    free(bmin); free(bmax); free(scratch);
     
     if (count > 0) {
-        printf("\n[Delete Demo] Removing: '%s'\n", results[0]->title);
-        results[0]->is_deleted = 1;
+        printf("\n[Delete Demo] Removing: '%s'\n", db.info[results[0]].title);
+        delete_range(&root, results[0]);
+        db.deleted[results[0]] = 1;
         
         printf("[Update Demo] Updating popularity...\n");
-        if(count > 1) update_range(&root, results[1], results[1]->values[1] + 10.0);
+        if(count > 1) update_range(&root, results[1], db.col[1][results[1]] + 10.0);
         
         int c2 = 0;
-        query_range(root, minv, maxv, results, &c2); 
+        t0 = wall_time();
+        query_range(root, minv, maxv, results, &c2);
+        t1 = wall_time();
+        Agg agg;
+        agg_range(root, minv, maxv, &agg);
+        print_agg(&agg, wall_time() - t1, c2, t1 - t0);
         
-        if(c2 > 0) run_knn(results[0], results, c2, 5);
+        if (c2 > 0) {
+            Neighbor nn[5];
+            int found = run_knn(results[0], results, c2, 5, nn);
+            print_neighbors("kNN Search", results[0], nn, found);
+        }
 
         if (c2 > 0) {
-            printf("\n[LSH Similarity - Banding] Target: %s\n", results[0]->title);
-            printf("(Showing candidates that collide in at least 1 band)\n");
-            int found_sim = 0;
-            for(int i=1; i<c2 && i<1000; i++) { 
-                if (check_lsh_bands(results[0], results[i])) {
-                    double sim = jaccard_similarity(results[0], results[i]);
-                    if (sim > 0.3) {
-                        printf(" -> Candidate: %s (Jaccard: %.2f)\n", results[i]->title, sim);
-                        found_sim++;
-                    }
-                }
-            }
-            if (found_sim == 0) printf("No similar text features found in query results.\n");
+            LshIndex lsh;
+            lsh_build(&lsh, db.count);
+            print_lsh_similar(&lsh, results[0], 0.3);
+            lsh_free(&lsh);
         }
     }
 
-    free_range(root);
-    free(data); free(ptrs); free(results);
+    reset_range_arena();
+    store_free(); free(ids); free(results);
     return 0;
-}
\ No newline at end of file
+}
+#endif
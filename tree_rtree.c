@@ -1,62 +1,93 @@
 #include "movies_common.h"
 
 #define MAX_CHILDREN 32 
+#define MIN_CHILDREN 13    // R*-tree: 40% of MAX_CHILDREN
+#define REINSERT_COUNT 10  // R*-tree: 30% of MAX_CHILDREN
 
 typedef struct RNode {
-    double min[K_DIMS], max[K_DIMS];
+    double min[MAX_DIMS], max[MAX_DIMS];
     struct RNode *children[MAX_CHILDREN];
-    Movie *data[MAX_CHILDREN];
+    int data[MAX_CHILDREN];
     int count;
     int is_leaf;
+    Agg *agg; // Internal nodes: live movies below, kept by update_mbr. NULL on leaves, which are scanned
 } RNode;
 
+Arena rtree_arena; // Every RNode lives here
+
+// One slot of a node while inserting, splitting or reinserting: a child
+// subtree or, at leaf level, a movie id, together with its box
+typedef struct {
+    double min[MAX_DIMS], max[MAX_DIMS];
+    struct RNode *child;
+    int id;
+} REntry;
+
+// Entries waiting to be (re)inserted; level is the height of the node they belong in
+typedef struct {
+    REntry e;
+    int level;
+} RPending;
+
+typedef struct {
+    RPending *pending;
+    int npending, cap;
+    unsigned int reinserted; // Levels that already used forced reinsertion
+} RInsertCtx;
+
 // RAM Calculation
 long get_rtree_memory(RNode *n) {
     if (!n) return 0;
-    long size = sizeof(RNode);
+    long size = sizeof(RNode) + (n->agg ? sizeof(Agg) : 0);
     if (!n->is_leaf) {
         for(int i=0; i<n->count; i++) size += get_rtree_memory(n->children[i]);
     }
     return size;
 }
 
-int check_lsh_bands(Movie *m1, Movie *m2) {
-    int bands = 5, rows = 4;
-    for (int b = 0; b < bands; b++) {
-        int match = 1;
-        for (int r = 0; r < rows; r++) {
-            if (m1->minhash_sig[b * rows + r] != m2->minhash_sig[b * rows + r]) { match = 0; break; }
-        }
-        if (match) return 1;
+// One comparator per dimension and key (min, max, center as min + max),
+// picked from cmp_entry[dim][key], so sorts share no state
+int cmp_key(double v1, double v2) { return (v1 > v2) - (v1 < v2); }
+
+#define ENTRY_CMPS(d) \
+    int cmp_min##d(const void *a, const void *b) { return cmp_key(((const REntry*)a)->min[d], ((const REntry*)b)->min[d]); } \
+    int cmp_max##d(const void *a, const void *b) { return cmp_key(((const REntry*)a)->max[d], ((const REntry*)b)->max[d]); } \
+    int cmp_center##d(const void *a, const void *b) { \
+        const REntry *e1 = a, *e2 = b; \
+        return cmp_key(e1->min[d] + e1->max[d], e2->min[d] + e2->max[d]); \
     }
-    return 0;
-}
+ENTRY_CMPS(0) ENTRY_CMPS(1) ENTRY_CMPS(2) ENTRY_CMPS(3) ENTRY_CMPS(4)
 
-int sort_dim = 0;
-int cmp_dim(const void *a, const void *b) { 
-    double v1 = (*(Movie**)a)->values[sort_dim];
-    double v2 = (*(Movie**)b)->values[sort_dim];
-    return (v1 > v2) - (v1 < v2);
+enum { KEY_MIN, KEY_MAX, KEY_CENTER };
+int (*const cmp_entry[MAX_DIMS][3])(const void *, const void *) = { // One row per dimension, MAX_DIMS rows
+    { cmp_min0, cmp_max0, cmp_center0 }, { cmp_min1, cmp_max1, cmp_center1 },
+    { cmp_min2, cmp_max2, cmp_center2 }, { cmp_min3, cmp_max3, cmp_center3 },
+    { cmp_min4, cmp_max4, cmp_center4 },
+};
+
+// Live movies of a subtree into a
+void rtree_agg_of(RNode *node, Agg *a) {
+    if (node->agg) { agg_merge(a, node->agg); return; }
+    for(int i=0; i<node->count; i++) agg_add(a, node->data[i]);
 }
 
-void update_mbr(RNode *node) {
-    for(int k=0; k<K_DIMS; k++) {
+// Bounding box only; update_mbr redoes the aggregate as well
+void update_box(RNode *node) {
+    for(int k=0; k<k_dims; k++) {
         node->min[k] = 1e15; node->max[k] = -1e15;
     }
     
     if (node->is_leaf) {
         for(int i=0; i<node->count; i++) {
-            Movie *m = node->data[i];
-            if (!m->is_deleted) { 
-                for(int k=0; k<K_DIMS; k++) {
-                    if(m->values[k] < node->min[k]) node->min[k] = m->values[k];
-                    if(m->values[k] > node->max[k]) node->max[k] = m->values[k];
-                }
+            int id = node->data[i];
+            for(int k=0; k<k_dims; k++) {
+                if(db.col[k][id] < node->min[k]) node->min[k] = db.col[k][id];
+                if(db.col[k][id] > node->max[k]) node->max[k] = db.col[k][id];
             }
         }
     } else {
          for(int i=0; i<node->count; i++) {
-             for(int k=0; k<K_DIMS; k++) {
+             for(int k=0; k<k_dims; k++) {
                  if(node->children[i]->min[k] < node->min[k]) node->min[k] = node->children[i]->min[k];
                  if(node->children[i]->max[k] > node->max[k]) node->max[k] = node->children[i]->max[k];
              }
@@ -64,106 +95,607 @@ void update_mbr(RNode *node) {
     }
 }
 
-RNode* build_rtree(Movie **mptr, int n) {
-    RNode *node = malloc(sizeof(RNode));
-    node->count = 0; node->is_leaf = 1;
-    
-    if (n <= MAX_CHILDREN) {
-        for(int i=0; i<n; i++) node->data[i] = mptr[i];
-        node->count = n;
-        update_mbr(node);
-        return node;
+void update_mbr(RNode *node) {
+    update_box(node);
+    if (!node->agg) return;
+    agg_clear(node->agg);
+    for(int i=0; i<node->count; i++) rtree_agg_of(node->children[i], node->agg);
+}
+
+// --- Box geometry, in the scaled units of euclidean_dist ---
+double box_area(const double *min, const double *max) {
+    double a = 1.0;
+    for(int k=0; k<k_dims; k++) a *= (max[k] - min[k]) / dim_scale(k);
+    return a;
+}
+
+double box_margin(const double *min, const double *max) {
+    double m = 0.0;
+    for(int k=0; k<k_dims; k++) m += (max[k] - min[k]) / dim_scale(k);
+    return m;
+}
+
+double box_overlap(const double *amin, const double *amax, const double *bmin, const double *bmax) {
+    double a = 1.0;
+    for(int k=0; k<k_dims; k++) {
+        double lo = amin[k] > bmin[k] ? amin[k] : bmin[k];
+        double hi = amax[k] < bmax[k] ? amax[k] : bmax[k];
+        if (hi < lo) return 0.0;
+        a *= (hi - lo) / dim_scale(k);
     }
-    
-    node->is_leaf = 0;
-    if (n > 1000) { 
-        sort_dim = 0; 
-        qsort(mptr, n, sizeof(Movie*), cmp_dim);
+    return a;
+}
+
+// Box of a and b together, written to out
+void box_union(const double *amin, const double *amax, const double *bmin, const double *bmax,
+               double *omin, double *omax) {
+    for(int k=0; k<k_dims; k++) {
+        omin[k] = amin[k] < bmin[k] ? amin[k] : bmin[k];
+        omax[k] = amax[k] > bmax[k] ? amax[k] : bmax[k];
     }
-    
-    int step = n / MAX_CHILDREN; 
-    if (n % MAX_CHILDREN != 0) step++; 
-    if (step < 1) step = 1;
-    
-    int current = 0;
-    while(current < n) {
-        if (node->count >= MAX_CHILDREN) break;
-        int remaining_slots = MAX_CHILDREN - node->count;
-        int remaining_items = n - current;
-        int chunk = remaining_items / remaining_slots;
-        if (remaining_items % remaining_slots != 0) chunk++;
-        
-        int end = current + chunk;
-        if (end > n) end = n;
-        
-        node->children[node->count++] = build_rtree(mptr + current, end - current);
-        current = end;
+}
+
+void entry_of(RNode *node, int i, REntry *e) {
+    if (node->is_leaf) {
+        e->child = NULL;
+        e->id = node->data[i];
+        for(int k=0; k<k_dims; k++) e->min[k] = e->max[k] = db.col[k][e->id];
+    } else {
+        e->child = node->children[i];
+        e->id = -1;
+        memcpy(e->min, e->child->min, sizeof(e->min));
+        memcpy(e->max, e->child->max, sizeof(e->max));
+    }
+}
+
+void entry_of_id(int id, REntry *e) {
+    e->child = NULL;
+    e->id = id;
+    for(int k=0; k<k_dims; k++) e->min[k] = e->max[k] = db.col[k][id];
+}
+
+void node_fill(RNode *node, REntry *all, int n) {
+    node->count = 0;
+    for(int i=0; i<n; i++) {
+        if (node->is_leaf) node->data[node->count++] = all[i].id;
+        else node->children[node->count++] = all[i].child;
     }
     update_mbr(node);
+}
+
+RNode* new_rnode(int is_leaf) {
+    RNode *node = arena_alloc(&rtree_arena, sizeof(RNode));
+    node->count = 0;
+    node->is_leaf = is_leaf;
+    node->agg = is_leaf ? NULL : arena_alloc(&rtree_arena, sizeof(Agg));
+    update_mbr(node);
     return node;
 }
 
-void free_rtree(RNode *node) {
-    if (!node) return;
-    if (!node->is_leaf) {
-        for(int i=0; i<node->count; i++) free_rtree(node->children[i]);
+void release_rnode(RNode *node) {
+    if (node->agg) arena_release(&rtree_arena, node->agg, sizeof(Agg));
+    arena_release(&rtree_arena, node, sizeof(RNode));
+}
+
+int rtree_height(RNode *node) {
+    int h = 0;
+    while (!node->is_leaf) { node = node->children[0]; h++; }
+    return h;
+}
+
+// --- Sort-Tile-Recursive bulk loading ---
+// Orders entries so that every run of MAX_CHILDREN is a compact tile: sort on
+// `dim`, cut into ceil(pages^(1/remaining dims)) slabs whose sizes are whole
+// pages, and tile each slab on the next dimension
+void str_tile(REntry *all, int n, int dim) {
+    qsort(all, n, sizeof(REntry), cmp_entry[dim][KEY_CENTER]);
+    if (dim == k_dims - 1 || n <= MAX_CHILDREN) return;
+    long pages = (n + MAX_CHILDREN - 1) / MAX_CHILDREN;
+    long slabs = (long)ceil(pow((double)pages, 1.0 / (k_dims - dim)));
+    long per = ((pages + slabs - 1) / slabs) * MAX_CHILDREN;
+    for(long start = 0; start < n; start += per) {
+        long len = (start + per <= n) ? per : n - start;
+        str_tile(all + start, (int)len, dim + 1);
+    }
+}
+
+// Tiles the level, packs consecutive runs into nodes and repeats on the
+// resulting node boxes until a single root remains
+RNode* build_rtree(int *ids, int n) {
+    if (n <= 0) return new_rnode(1);
+    REntry *level = malloc(n * sizeof(REntry));
+    for(int i=0; i<n; i++) entry_of_id(ids[i], &level[i]);
+    int is_leaf = 1;
+    while (1) {
+        str_tile(level, n, 0);
+        int nodes = (n + MAX_CHILDREN - 1) / MAX_CHILDREN;
+        for(int i=0; i<nodes; i++) {
+            int len = (i == nodes - 1) ? n - i * MAX_CHILDREN : MAX_CHILDREN;
+            RNode *node = new_rnode(is_leaf);
+            node_fill(node, level + i * MAX_CHILDREN, len);
+            REntry e = { {0}, {0}, node, -1 };
+            memcpy(e.min, node->min, sizeof(e.min));
+            memcpy(e.max, node->max, sizeof(e.max));
+            level[i] = e; // Safe: slot i is behind the runs still to be read
+        }
+        n = nodes;
+        is_leaf = 0;
+        if (n == 1) break;
+    }
+    RNode *root = level[0].child;
+    free(level);
+    return root;
+}
+
+// O(1) in the node count: frees every node of the arena, so the tree in
+// use is gone and the next build starts fresh
+void reset_rtree_arena(void) {
+    arena_free(&rtree_arena);
+}
+
+// --- R*-tree insertion ---
+void push_pending(RInsertCtx *ctx, REntry *e, int level) {
+    if (ctx->npending == ctx->cap) {
+        ctx->cap = ctx->cap ? ctx->cap * 2 : 32;
+        ctx->pending = realloc(ctx->pending, ctx->cap * sizeof(RPending));
+    }
+    ctx->pending[ctx->npending].e = *e;
+    ctx->pending[ctx->npending].level = level;
+    ctx->npending++;
+}
+
+// Queues every movie of a subtree for leaf-level reinsertion and frees its nodes
+void push_subtree_ids(RNode *node, RInsertCtx *ctx) {
+    for(int i=0; i<node->count; i++) {
+        if (node->is_leaf) {
+            REntry e;
+            entry_of_id(node->data[i], &e);
+            push_pending(ctx, &e, 0);
+        } else push_subtree_ids(node->children[i], ctx);
+    }
+    release_rnode(node);
+}
+
+// Children are leaves: least overlap enlargement. Otherwise: least area
+// enlargement. Ties go to the smaller area, then the smaller margin growth.
+int choose_subtree(RNode *node, REntry *e) {
+    int leaves_below = node->children[0]->is_leaf;
+    int best = 0;
+    double best_key[3] = { INFINITY, INFINITY, INFINITY };
+    for(int i=0; i<node->count; i++) {
+        RNode *c = node->children[i];
+        double umin[MAX_DIMS], umax[MAX_DIMS];
+        box_union(c->min, c->max, e->min, e->max, umin, umax);
+        double area = box_area(c->min, c->max);
+        double key[3];
+        key[0] = box_area(umin, umax) - area;
+        key[1] = area;
+        key[2] = box_margin(umin, umax) - box_margin(c->min, c->max);
+        if (leaves_below) {
+            double grow = 0.0;
+            for(int j=0; j<node->count; j++) {
+                if (j == i) continue;
+                RNode *o = node->children[j];
+                grow += box_overlap(umin, umax, o->min, o->max) - box_overlap(c->min, c->max, o->min, o->max);
+            }
+            key[2] = key[1]; key[1] = key[0]; key[0] = grow;
+        }
+        int better = 0;
+        for(int k=0; k<3; k++) {
+            if (key[k] < best_key[k]) { better = 1; break; }
+            if (key[k] > best_key[k]) break;
+        }
+        if (better) { best = i; memcpy(best_key, key, sizeof(key)); }
+    }
+    return best;
+}
+
+// Bounding boxes of all[0..i] (prefix) and all[i..n-1] (suffix)
+void split_boxes(REntry *all, int n, double pmin[][MAX_DIMS], double pmax[][MAX_DIMS],
+                 double smin[][MAX_DIMS], double smax[][MAX_DIMS]) {
+    memcpy(pmin[0], all[0].min, sizeof(pmin[0])); memcpy(pmax[0], all[0].max, sizeof(pmax[0]));
+    for(int i=1; i<n; i++) box_union(pmin[i-1], pmax[i-1], all[i].min, all[i].max, pmin[i], pmax[i]);
+    memcpy(smin[n-1], all[n-1].min, sizeof(smin[0])); memcpy(smax[n-1], all[n-1].max, sizeof(smax[0]));
+    for(int i=n-2; i>=0; i--) box_union(smin[i+1], smax[i+1], all[i].min, all[i].max, smin[i], smax[i]);
+}
+
+// R* split: the axis with the smallest total margin, then the distribution on
+// that axis with the least overlap (ties: least total area). node keeps the
+// first group, the returned sibling gets the second.
+RNode* split_node(RNode *node, REntry *all, int n) {
+    double pmin[MAX_CHILDREN + 1][MAX_DIMS], pmax[MAX_CHILDREN + 1][MAX_DIMS];
+    double smin[MAX_CHILDREN + 1][MAX_DIMS], smax[MAX_CHILDREN + 1][MAX_DIMS];
+    int best_axis = 0;
+    double best_margin = INFINITY;
+    for(int d=0; d<k_dims; d++) {
+        double margin = 0.0;
+        for(int s=0; s<2; s++) {
+            qsort(all, n, sizeof(REntry), cmp_entry[d][s ? KEY_MAX : KEY_MIN]);
+            split_boxes(all, n, pmin, pmax, smin, smax);
+            for(int k=MIN_CHILDREN; k<=n-MIN_CHILDREN; k++)
+                margin += box_margin(pmin[k-1], pmax[k-1]) + box_margin(smin[k], smax[k]);
+        }
+        if (margin < best_margin) { best_margin = margin; best_axis = d; }
+    }
+
+    int best_sort = 0, best_k = MIN_CHILDREN;
+    double best_overlap = INFINITY, best_area = INFINITY;
+    for(int s=0; s<2; s++) {
+        qsort(all, n, sizeof(REntry), cmp_entry[best_axis][s ? KEY_MAX : KEY_MIN]);
+        split_boxes(all, n, pmin, pmax, smin, smax);
+        for(int k=MIN_CHILDREN; k<=n-MIN_CHILDREN; k++) {
+            double overlap = box_overlap(pmin[k-1], pmax[k-1], smin[k], smax[k]);
+            double area = box_area(pmin[k-1], pmax[k-1]) + box_area(smin[k], smax[k]);
+            if (overlap < best_overlap || (overlap == best_overlap && area < best_area)) {
+                best_overlap = overlap; best_area = area; best_sort = s; best_k = k;
+            }
+        }
+    }
+    qsort(all, n, sizeof(REntry), cmp_entry[best_axis][best_sort ? KEY_MAX : KEY_MIN]);
+
+    RNode *sibling = new_rnode(node->is_leaf);
+    node_fill(node, all, best_k);
+    node_fill(sibling, all + best_k, n - best_k);
+    return sibling;
+}
+
+double center_dist(REntry *e, double *cmin, double *cmax) {
+    double sum = 0.0;
+    for(int k=0; k<k_dims; k++) {
+        double diff = ((e->min[k] + e->max[k]) - (cmin[k] + cmax[k])) / (2.0 * dim_scale(k));
+        sum += diff * diff;
+    }
+    return sum;
+}
+
+// Forced reinsertion: the entries farthest from the node's centre are taken
+// out and queued, which often avoids the split and tightens the node
+void reinsert_far(RNode *node, REntry *all, int n, int level, RInsertCtx *ctx) {
+    double cmin[MAX_DIMS], cmax[MAX_DIMS];
+    memcpy(cmin, all[0].min, sizeof(cmin)); memcpy(cmax, all[0].max, sizeof(cmax));
+    for(int i=1; i<n; i++) box_union(cmin, cmax, all[i].min, all[i].max, cmin, cmax);
+    double dist[MAX_CHILDREN + 1];
+    for(int i=0; i<n; i++) dist[i] = center_dist(&all[i], cmin, cmax);
+    // Selection of the REINSERT_COUNT farthest to the tail
+    for(int r=0; r<REINSERT_COUNT; r++) {
+        int far = 0;
+        for(int i=1; i<n-r; i++) if (dist[i] > dist[far]) far = i;
+        REntry te = all[far]; all[far] = all[n-r-1]; all[n-r-1] = te;
+        double td = dist[far]; dist[far] = dist[n-r-1]; dist[n-r-1] = td;
+    }
+    node_fill(node, all, n - REINSERT_COUNT);
+    for(int i=n-REINSERT_COUNT; i<n; i++) push_pending(ctx, &all[i], level);
+}
+
+// Adds e to a full node: forced reinsertion the first time this level
+// overflows during one operation, a split after that. Returns the new sibling or NULL.
+RNode* overflow_node(RNode *node, REntry *e, int level, int is_root, RInsertCtx *ctx) {
+    REntry all[MAX_CHILDREN + 1];
+    for(int i=0; i<node->count; i++) entry_of(node, i, &all[i]);
+    all[node->count] = *e;
+    int n = node->count + 1;
+    if (!is_root && !(ctx->reinserted & (1u << level))) {
+        ctx->reinserted |= 1u << level;
+        reinsert_far(node, all, n, level, ctx);
+        return NULL;
+    }
+    return split_node(node, all, n);
+}
+
+RNode* insert_rec(RNode *node, REntry *e, int e_level, int node_level, int is_root, RInsertCtx *ctx) {
+    REntry sib_entry;
+    if (node_level > e_level) {
+        int i = choose_subtree(node, e), pending = ctx->npending;
+        RNode *sib = insert_rec(node->children[i], e, e_level, node_level - 1, 0, ctx);
+        if (!sib && ctx->npending == pending) {
+            // The subtree only gained e: widen the box and fold e's movies in
+            for(int k=0; k<k_dims; k++) {
+                if (e->min[k] < node->min[k]) node->min[k] = e->min[k];
+                if (e->max[k] > node->max[k]) node->max[k] = e->max[k];
+            }
+            if (e->child) rtree_agg_of(e->child, node->agg);
+            else agg_add(node->agg, e->id);
+            return NULL;
+        }
+        if (!sib) { update_mbr(node); return NULL; } // Entries left for reinsertion
+        sib_entry.child = sib; sib_entry.id = -1;
+        memcpy(sib_entry.min, sib->min, sizeof(sib_entry.min));
+        memcpy(sib_entry.max, sib->max, sizeof(sib_entry.max));
+        e = &sib_entry;
+    }
+    if (node->count < MAX_CHILDREN) {
+        if (node->is_leaf) node->data[node->count++] = e->id;
+        else node->children[node->count++] = e->child;
+        update_mbr(node);
+        return NULL;
     }
-    free(node);
+    return overflow_node(node, e, node_level, is_root, ctx);
 }
 
-void update_rtree(RNode *root, Movie *target, double new_pop) {
-    printf(" [Update] Moved '%s' (Pop: %.2f -> %.2f)\n", target->title, target->values[1], new_pop);
-    target->values[1] = new_pop;
+void insert_entry(RNode **root, REntry *e, int level, RInsertCtx *ctx) {
+    int h = rtree_height(*root);
+    if (level > h) { push_subtree_ids(e->child, ctx); return; } // Tree shrank below it
+    RNode *sib = insert_rec(*root, e, level, h, 1, ctx);
+    if (sib) {
+        RNode *new_root = new_rnode(0);
+        new_root->children[0] = *root;
+        new_root->children[1] = sib;
+        new_root->count = 2;
+        update_mbr(new_root);
+        *root = new_root;
+    }
 }
 
-void query_rtree(RNode *node, double min[], double max[], Movie **res, int *cnt) {
-    if (!node) return;
-    for(int k=0; k<K_DIMS; k++) {
-        if (node->min[k] > max[k] || node->max[k] < min[k]) return;
+void flush_pending(RNode **root, RInsertCtx *ctx) {
+    while (ctx->npending > 0) {
+        RPending p = ctx->pending[--ctx->npending];
+        insert_entry(root, &p.e, p.level, ctx);
     }
+    free(ctx->pending);
+}
+
+void insert_rtree(RNode **root, int id) {
+    RInsertCtx ctx = { NULL, 0, 0, 0 };
+    REntry e;
+    entry_of_id(id, &e);
+    insert_entry(root, &e, 0, &ctx);
+    flush_pending(root, &ctx);
+}
+
+// --- Deletion with condensing ---
+// Removes id below node. Underfull nodes on the path are dissolved and their
+// entries queued for reinsertion at their own level. Returns 1 if found.
+int delete_rec(RNode *node, int id, int node_level, RInsertCtx *ctx) {
     if (node->is_leaf) {
         for(int i=0; i<node->count; i++) {
-             Movie *m = node->data[i];
-             if (!m->is_deleted) { 
-                int match = 1;
-                for(int k=0; k<K_DIMS; k++) {
-                    if (m->values[k] < min[k] || m->values[k] > max[k]) { match=0; break; }
-                }
-                if (match) res[(*cnt)++] = m;
+            if (node->data[i] != id) continue;
+            node->data[i] = node->data[--node->count];
+            update_mbr(node);
+            return 1;
+        }
+        return 0;
+    }
+    for(int i=0; i<node->count; i++) {
+        RNode *c = node->children[i];
+        int pending = ctx->npending;
+        if (!point_in_box(id, c->min, c->max) || !delete_rec(c, id, node_level - 1, ctx)) continue;
+        if (c->count < MIN_CHILDREN) {
+            for(int j=0; j<c->count; j++) {
+                REntry e;
+                entry_of(c, j, &e);
+                push_pending(ctx, &e, node_level - 1);
             }
+            release_rnode(c);
+            node->children[i] = node->children[--node->count];
+            update_mbr(node);
+            return 1;
+        }
+        // When only id left the subtree, the aggregate is rebuilt only if id may have set an extreme
+        update_box(node);
+        if (ctx->npending != pending || !agg_remove(node->agg, id)) update_mbr(node);
+        return 1;
+    }
+    return 0;
+}
+
+// Must be called while the movie still has the coordinates it was indexed with
+int delete_rtree(RNode **root, int id) {
+    RInsertCtx ctx = { NULL, 0, 0, 0 };
+    int found = delete_rec(*root, id, rtree_height(*root), &ctx);
+    if (!(*root)->is_leaf && (*root)->count == 0) {
+        release_rnode(*root);
+        *root = new_rnode(1);
+    }
+    flush_pending(root, &ctx);
+    while (!(*root)->is_leaf && (*root)->count == 1) {
+        RNode *old = *root;
+        *root = old->children[0];
+        release_rnode(old);
+    }
+    return found;
+}
+
+void update_rtree(RNode **root, int target, double new_pop) {
+    printf(" [Update] Moved '%s' (Pop: %.2f -> %.2f)\n", db.info[target].title, db.col[1][target], new_pop);
+    delete_rtree(root, target);
+    store_set(target, 1, new_pop);
+    insert_rtree(root, target);
+}
+
+void query_rtree(RNode *node, double min[], double max[], int *res, int *cnt) {
+    if (!node || !box_overlaps(node->min, node->max, min, max)) return;
+    if (node->is_leaf) {
+        for(int i=0; i<node->count; i++) {
+            int id = node->data[i];
+            if (!db.deleted[id] && point_in_box(id, min, max)) res[(*cnt)++] = id;
         }
     } else {
         for(int i=0; i<node->count; i++) query_rtree(node->children[i], min, max, res, cnt);
     }
 }
 
-int main() {
-    Movie *data = malloc(MAX_MOVIES * sizeof(Movie));
-    int total_n = load_csv("movies.csv", data);
-    Movie **ptrs = malloc(total_n * sizeof(Movie*));
-    Movie **results = malloc(total_n * sizeof(Movie*));
+// Count/sum/min/max over the box without listing the movies
+void agg_rtree_rec(RNode *node, double min[], double max[], Agg *out) {
+    if (!box_overlaps(node->min, node->max, min, max)) return;
+    if (node->agg) {
+        if (agg_disjoint(node->agg, min, max)) return;
+        if (agg_inside(node->agg, min, max)) { agg_merge(out, node->agg); return; }
+    }
+    if (node->is_leaf) {
+        for(int i=0; i<node->count; i++) {
+            if (point_in_box(node->data[i], min, max)) agg_add(out, node->data[i]);
+        }
+    } else {
+        for(int i=0; i<node->count; i++) agg_rtree_rec(node->children[i], min, max, out);
+    }
+}
+
+void agg_rtree(RNode *root, double min[], double max[], Agg *out) {
+    agg_clear(out);
+    if (root) agg_rtree_rec(root, min, max, out);
+}
+
+// --- Parallel query: tasks are the subtrees below the first few levels ---
+void rtree_query_task(QueryTask *t, double min[], double max[], int *res, int *cnt) {
+    query_rtree(t->node, min, max, res, cnt);
+}
+
+int rtree_query_expand(QueryTask *t, double min[], double max[], QueryTaskList *out, int *res, int *cnt) {
+    (void)res; (void)cnt; // Internal nodes hold no movies to report
+    RNode *node = t->node;
+    if (!box_overlaps(node->min, node->max, min, max)) return 1;
+    if (node->is_leaf) return 0;
+    for(int i=0; i<node->count; i++) task_push(out, node->children[i], 0);
+    return 1;
+}
+
+// --- Batched query: one traversal for a set of boxes ---
+void batch_rtree(RNode *node, BoxBatch *b, int act, int nact) {
+    int off = batch_reserve(b, nact), m = 0;
+    for(int i=0; i<nact; i++) {
+        int box = b->stack[act + i];
+        if (box_overlaps(node->min, node->max, b->min[box], b->max[box])) b->stack[off + m++] = box;
+    }
+    if (m > 0) {
+        if (node->is_leaf) {
+            batch_report_ids(b, node->data, node->count, off, m);
+        } else {
+            for(int i=0; i<node->count; i++) batch_rtree(node->children[i], b, off, m);
+        }
+    }
+    b->top = off;
+}
+
+void query_rtree_batch(RNode *root, BoxBatch *b) {
+    if (!root) return;
+    int act = batch_all(b);
+    batch_rtree(root, b, act, b->nboxes);
+    b->top = act;
+}
+
+void query_rtree_par(RNode *root, double min[], double max[], int *res, int *cnt) {
+    if (!root) return;
+    QueryTask t = { root, 0 };
+    query_parallel(t, rtree_query_expand, rtree_query_task, min, max, res, cnt);
+}
+
+// --- Snapshot image: BFS box tree ---
+void rtree_image_size(RNode *n, int *nodes, int *ids) {
+    (*nodes)++;
+    if (n->is_leaf) *ids += n->count;
+    else {
+        for(int i=0; i<n->count; i++) rtree_image_size(n->children[i], nodes, ids);
+    }
+}
+
+void encode_rtree(RNode *root, BoxImageNode *nodes, int nnodes, int *ids) {
+    RNode **queue = malloc(nnodes * sizeof(RNode*)); // Source of every image slot
+    int tail = 0, nid = 0;
+    queue[tail++] = root;
+    for(int head=0; head<tail; head++) {
+        RNode *n = queue[head];
+        BoxImageNode *img = &nodes[head];
+        memcpy(img->min, n->min, sizeof(img->min));
+        memcpy(img->max, n->max, sizeof(img->max));
+        img->is_leaf = n->is_leaf;
+        img->count = n->count;
+        img->pad = 0;
+        if (n->is_leaf) {
+            img->first = nid;
+            for(int i=0; i<n->count; i++) ids[nid++] = n->data[i];
+        } else {
+            img->first = tail;
+            for(int i=0; i<n->count; i++) queue[tail++] = n->children[i];
+        }
+    }
+    free(queue);
+}
+
+int save_rtree_snapshot(const char *path, int *ids, int n) {
+    for(int i=0; i<n; i++) ids[i] = i;
+    RNode *root = build_rtree(ids, n);
+    int nnodes = 0, nids = 0;
+    if (root) rtree_image_size(root, &nnodes, &nids);
+    BoxImageNode *nodes = malloc((nnodes > 0 ? nnodes : 1) * sizeof(BoxImageNode));
+    int *img_ids = malloc((nids > 0 ? nids : 1) * sizeof(int));
+    if (root) encode_rtree(root, nodes, nnodes, img_ids);
+
+    SnapWriter w;
+    int ok = snap_create(&w, path);
+    if (ok) {
+        snap_write(&w, "rtree.nodes", nodes, nnodes * sizeof(BoxImageNode));
+        snap_write(&w, "rtree.ids", img_ids, nids * sizeof(int));
+        ok = snap_finish(&w);
+        if (ok) printf("[Snapshot] Wrote %s\n", path);
+    }
+    free(nodes); free(img_ids);
+    reset_rtree_arena();
+    return ok;
+}
+
+int run_rtree_snapshot(const char *path) {
+    double t0 = wall_time();
+    Snapshot s;
+    if (!snap_open(&s, path)) return 1;
+    long long size, nids;
+    const BoxImageNode *nodes = snap_find(&s, "rtree.nodes", &size);
+    const int *ids = snap_find(&s, "rtree.ids", &nids);
+    if (!nodes || !ids) {
+        printf("ERROR: %s holds no R-tree.\n", path);
+        snap_close(&s);
+        return 1;
+    }
+    if (!box_image_valid(nodes, size / (long long)sizeof(BoxImageNode), ids, nids / (long long)sizeof(int))) {
+        printf("ERROR: %s: corrupt R-tree sections.\n", path);
+        snap_close(&s);
+        return 1;
+    }
+    double t1 = wall_time();
+
+    double minv[MAX_DIMS], maxv[MAX_DIMS];
+    demo_box(minv, maxv);
+    int *results = malloc((db.count > 0 ? db.count : 1) * sizeof(int));
+    int count = 0;
+    if (size >= (long long)sizeof(BoxImageNode)) query_box_image(nodes, ids, 0, minv, maxv, results, &count);
+    print_snapshot_demo(path, t1 - t0, wall_time() - t1, results, count);
+    free(results);
+    snap_close(&s);
+    return 0;
+}
+
+#ifndef TREE_NO_MAIN
+int main(int argc, char **argv) {
+    if (argc > 2 && strcmp(argv[1], "--snapshot") == 0) return run_rtree_snapshot(argv[2]);
+    int total_n = load_csv("movies.csv");
+    int *ids = malloc(total_n * sizeof(int));
+    int *results = malloc(total_n * sizeof(int));
     
-    // ΔΙΟΡΘΩΣΗ ΓΙΑ 2D
-    double minv[K_DIMS], maxv[K_DIMS];
-    minv[0] = 1000; maxv[0] = 50000; 
-    if (K_DIMS > 1) { minv[1] = 2;    maxv[1] = 50; }
-    if (K_DIMS > 2) { minv[2] = 60;   maxv[2] = 180; }
-    for(int i=3; i<K_DIMS; i++) { minv[i] = -1e9; maxv[i] = 1e9; }
-
-    printf("\n=== R-Tree (%d Dimensions) ===\n", K_DIMS);
+    double minv[MAX_DIMS], maxv[MAX_DIMS];
+    demo_box(minv, maxv);
+
+    if (argc > 2 && strcmp(argv[1], "--save-snapshot") == 0) {
+        int ok = save_rtree_snapshot(argv[2], ids, total_n);
+        store_free(); free(ids); free(results);
+        return ok ? 0 : 1;
+    }
+
+    printf("\n=== R-Tree (%d Dimensions) ===\n", k_dims);
     printf("--------------------------------------------------------------------------\n");
     printf("| Size         | Build (s) | Insert (s) | Query (s) | Memory (MB) |\n");
     printf("--------------------------------------------------------------------------\n");
 
     int step = 20000;
     for(int n = step; n <= total_n; n += step) {
-        for(int i=0; i<n; i++) ptrs[i] = &data[i];
+        for(int i=0; i<n; i++) ids[i] = i;
         
+        // The last movie is left out of the build and inserted on its own
         clock_t start = clock();
-        RNode *root = build_rtree(ptrs, n);
+        RNode *root = build_rtree(ids, n - 1);
         double build_time = (double)(clock()-start)/CLOCKS_PER_SEC;
         
-        double insert_time = 0.0; 
+        start = clock();
+        insert_rtree(&root, n - 1);
+        double insert_time = (double)(clock()-start)/CLOCKS_PER_SEC;
 
         int count = 0;
         start = clock();
@@ -174,47 +706,86 @@ int main() {
         double mem_mb = bytes / (1024.0 * 1024.0);
         
         printf("| %-12d | %-9.4f | %-10.4f | %-9.4f | %-11.2f |\n", n, build_time, insert_time, query_time, mem_mb);
-        free_rtree(root);
+        reset_rtree_arena();
     }
     printf("--------------------------------------------------------------------------\n");
 
     // DEMO
-    for(int i=0; i<total_n; i++) ptrs[i] = &data[i];
-    RNode *root = build_rtree(ptrs, total_n);
+    for(int i=0; i<total_n; i++) ids[i] = i;
+    RNode *root = build_rtree(ids, total_n);
     int count = 0;
     query_rtree(root, minv, maxv, results, &count);
     printf("Query Found: %d movies\n", count);
+    // Wide box matching the whole catalog, sequential vs parallel. These
+    // timings get their own buffer; results keeps the demo box for below.
+    int *scratch = malloc((db.count > 0 ? db.count : 1) * sizeof(int));
+    double wmin[MAX_DIMS], wmax[MAX_DIMS];
+    for(int i=0; i<k_dims; i++) { wmin[i] = -INFINITY; wmax[i] = INFINITY; }
+    int c_seq = 0, c_par = 0;
+    query_pool_start();
+    double t0 = wall_time();
+    query_rtree(root, wmin, wmax, scratch, &c_seq);
+    double t1 = wall_time();
+    query_rtree_par(root, wmin, wmax, scratch, &c_par);
+    double t2 = wall_time();
+    printf("[Parallel Query] Wide box: %d movies in %.4fs on 1 thread, %d movies in %.4fs on %d threads\n",
+           c_seq, t1 - t0, c_par, t2 - t1, qpool.nthreads);
+
+    // A page of boxes answered in one batched traversal vs one query each
+    int nbox = 200;
+    double (*bmin)[MAX_DIMS] = malloc(nbox * sizeof(*bmin)), (*bmax)[MAX_DIMS] = malloc(nbox * sizeof(*bmax));
+    random_boxes(bmin, bmax, nbox, 42);
+    BoxBatch batch;
+    batch_init(&batch, bmin, bmax, nbox);
+    t0 = wall_time();
+    query_rtree_batch(root, &batch);
+    t1 = wall_time();
+    int c_single = 0;
+    for(int i=0; i<nbox; i++) {
+        int c = 0;
+        query_rtree(root, bmin[i], bmax[i], scratch, &c);
+        c_single += c;
+    }
+    t2 = wall_time();
+    int c_batch = 0;
+    for(int i=0; i<nbox; i++) c_batch += batch.cnt[i];
+    printf("[Batch Query] %d boxes: %d matches in %.4fs batched, %d matches in %.4fs one by one\n",
+           nbox, c_batch, t1 - t0, c_single, t2 - t1);
+    batch_free(&batch);
+    free(bmin); free(bmax); free(scratch);
     
     if (count > 0) {
-        printf("\n[Delete Demo] Removing: '%s'\n", results[0]->title);
-        results[0]->is_deleted = 1;
+        printf("\n[Delete Demo] Removing: '%s'\n", db.info[results[0]].title);
+        db.deleted[results[0]] = 1;
+        delete_rtree(&root, results[0]);
         
         printf("[Update Demo] Updating popularity...\n");
-        if(count > 1) update_rtree(root, results[1], results[1]->values[1] + 10.0);
+        if(count > 1) update_rtree(&root, results[1], db.col[1][results[1]] + 10.0);
         
         int c2 = 0;
-        query_rtree(root, minv, maxv, results, &c2); 
+        t0 = wall_time();
+        query_rtree(root, minv, maxv, results, &c2);
+        t1 = wall_time();
+        Agg agg;
+        agg_rtree(root, minv, maxv, &agg);
+        print_agg(&agg, wall_time() - t1, c2, t1 - t0);
         
-        if(c2 > 0) run_knn(results[0], results, c2, 5);
+        if (c2 > 0) {
+            Neighbor nn[5];
+            int found = run_knn(results[0], results, c2, 5, nn);
+            print_neighbors("kNN Search", results[0], nn, found);
+        }
 
         if (c2 > 0) {
-            printf("\n[LSH Similarity - Banding] Target: %s\n", results[0]->title);
-            printf("(Showing candidates that collide in at least 1 band)\n");
-            int found_sim = 0;
-            for(int i=1; i<c2 && i<1000; i++) { 
-                if (check_lsh_bands(results[0], results[i])) {
-                    double sim = jaccard_similarity(results[0], results[i]);
-                    if (sim > 0.3) {
-                        printf(" -> Candidate: %s (Jaccard: %.2f)\n", results[i]->title, sim);
-                        found_sim++;
-                    }
-                }
-            }
-            if (found_sim == 0) printf("No similar text features found in query results.\n");
+            LshIndex lsh;
+            lsh_build(&lsh, db.count);
+            print_lsh_similar(&lsh, results[0], 0.3);
+            lsh_free(&lsh);
         }
     }
     
-    free_rtree(root);
-    free(data); free(ptrs); free(results);
+    reset_rtree_arena();
+    store_free(); free(ids); free(results);
     return 0;
-}
\ No newline at end of file
+}
+#endif